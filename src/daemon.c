@@ -0,0 +1,850 @@
+/* snitch/daemon.c -- The event loop and proxy state of the SNItch daemon.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <assert.h>
+
+#include <unistd.h>
+#include <sched.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fun.h"
+
+
+/* Linux specific bit; setting it to 0 makes code skip those sections */
+#ifndef POLLRDHUP
+#define POLLRDHUP 0
+#endif
+
+
+/* Global variables */
+volatile sig_atomic_t interrupted = 0;
+volatile sig_atomic_t trace_requested = 0;
+uint32_t cnx_counter = 0;
+uint64_t now = 0;
+unsigned int cnx_active = 0;
+unsigned int cnx_resume = 0;
+unsigned int cnx_busypoll = 0;
+uint64_t spin_max = 0;
+uint64_t spin_budget = 0;
+bool busypoll_warned = false;
+uint64_t listen_retry = 0;
+bool listen_paused = false;
+int spare_fd = -1;
+struct pollfd *polls = NULL;
+pollidx_t polls_used = 0;
+pollidx_t polls_allocated = 0;
+struct proxy *proxies = NULL;
+pollidx_t proxies_allocated = 0;
+#define proxies_used polls_used
+struct mapping *mappings = NULL;
+
+
+/* File descriptors reserved for purposes other than connections */
+#define RESERVED_FDS 16
+
+/* Time to wait before retrying accept() after running out of fds */
+#define LISTEN_RETRY_NS 1000000000ULL
+
+/* Shortest spin before blocking in low-latency mode */
+#define SPIN_MIN_NS 1000
+
+
+
+/* Allocate a polling entry; return INVALID_POLLIDX on failure. */
+pollidx_t allocate_pollfd (int fd, short events) {
+	if (polls_used == polls_allocated) {
+		struct pollfd *newpolls = realloc (polls, (polls_allocated + 100) * sizeof (struct pollfd));
+		if (!newpolls) {
+			return INVALID_POLLIDX;
+		}
+		polls = newpolls;
+		polls_allocated += 100;
+	}
+	polls [polls_used].fd = fd;
+	polls [polls_used].events = events;
+	polls [polls_used].revents = 0;
+	return polls_used++;
+}
+
+/* Free a polling entry */
+//TODO// Mark entries for garbage collection or reuse and skip renumbering?
+void free_pollfd (pollidx_t idx) {
+	int old;
+	assert (idx <= polls_used);
+	assert (idx != INVALID_POLLIDX);
+	old = polls_used - 1;
+	if (idx < old) {
+		int ctr;
+		memcpy (&polls [idx], &polls [old], sizeof (struct pollfd));
+		memcpy (&proxies [idx], &proxies [old], sizeof (struct proxy));
+		for (ctr = 0; ctr < polls_used-1; ctr++) {
+			if (proxies [ctr].pollidx == old) {
+				proxies [ctr].pollidx = idx;
+			}
+			if (proxies [ctr].peeridx == old) {
+				proxies [ctr].peeridx = idx;
+			}
+		}
+	}
+	polls_used--;
+}
+
+/* Allocate a proxy entry for a given pollidx_t value.  The idea is to call
+ * this with the pollidx_t returned from allocate_pollfd(), and always call
+ * this right afterwards to allocate control structures.
+ * Each proxy structure reflects one side of the proxying relationship.
+ * When this function fails, it returns -1 and otherwise it returns the
+ * idx it got sent.  In case of error, you should not continue to rely on
+ * the pollfd either, if your program assumes that they work together.
+ */
+int allocate_proxy (pollidx_t idx) {
+	assert (idx <= polls_used);
+	assert (idx != INVALID_POLLIDX);
+	if (idx >= proxies_allocated) {
+		struct proxy *newpxy = realloc (proxies, polls_allocated * sizeof (struct proxy));
+		if (newpxy == NULL) {
+			return -1;
+		}
+		proxies = newpxy;
+		proxies_allocated = polls_allocated;
+	}
+	memset (proxies + idx, 0, sizeof (struct proxy));
+	proxies [idx].pollidx = idx;	//TODO// Do we need this? It renumbers!
+	proxies [idx].peeridx = INVALID_POLLIDX;
+	return idx;
+}
+
+/* Free a proxy entry.  This currently does nothing, but the idea is to call
+ * it sort of "in parallel" with free_pollfd, using the same idx to both but
+ * not minding in what order they are called.
+ */
+void free_proxy (pollidx_t idx) {
+	;
+}
+
+/* Parse a numeric flag of the form name=value into *value.
+ * Returns true when the flag has the given name and a proper value.
+ */
+bool mapping_flag_value (char *flag, size_t flaglen, char *name, uint32_t *value) {
+	size_t namelen = strlen (name);
+	unsigned long ulval;
+	char *end;
+	if ((flaglen <= namelen + 1) || (memcmp (flag, name, namelen) != 0) || (flag [namelen] != '=')) {
+		return false;
+	}
+	errno = 0;
+	ulval = strtoul (flag + namelen + 1, &end, 10);
+	if ((errno != 0) || (end != flag + flaglen) || (ulval > UINT32_MAX)) {
+		return false;
+	}
+	*value = (uint32_t) ulval;
+	return true;
+}
+
+/* Parse the flags of a mapping, which are separated by whitespace.
+ * Returns 0 on success, or -1 after reporting an unknown flag.
+ */
+int parse_mapping_flags (struct mapping *map) {
+	char *flag = map->flags;
+	struct addrprefix *newfrom;
+	while (flag && *flag) {
+		size_t flaglen;
+		flag += strspn (flag, " \t");
+		flaglen = strcspn (flag, " \t");
+		if (flaglen == 0) {
+			break;
+		}
+		//
+		// Client address prefixes may be given repeatedly
+		//
+		if ((flaglen > 5) && (memcmp (flag, "from=", 5) == 0)) {
+			newfrom = realloc (map->from, (map->from_count + 1) * sizeof (struct addrprefix));
+			if (newfrom == NULL) {
+				return -1;
+			}
+			map->from = newfrom;
+			if (!route_parse_prefix (flag + 5, flaglen - 5, &map->from [map->from_count])) {
+				fprintf (stderr, "Bad address prefix %.*s for %s\n", (int) flaglen, flag, map->label);
+				return -1;
+			}
+			map->from_count++;
+		} else if (!mapping_flag_value (flag, flaglen, "rate",     &map->maprate) &&
+		    !mapping_flag_value (flag, flaglen, "burst",    &map->mapburst) &&
+		    !mapping_flag_value (flag, flaglen, "cnxrate",  &map->cnxrate) &&
+		    !mapping_flag_value (flag, flaglen, "cnxburst", &map->cnxburst) &&
+		    !mapping_flag_value (flag, flaglen, "maxcnx",   &map->maxcnx) &&
+		    !mapping_flag_value (flag, flaglen, "busypoll", &map->busypoll)) {
+			fprintf (stderr, "Unknown flag %.*s for %s\n", (int) flaglen, flag, map->label);
+			return -1;
+		}
+		flag += flaglen;
+	}
+	return 0;
+}
+
+/* Setup the fixed pollfd entries and their proxies, for the listener
+ * and the resolver.  Returns 0 on success, or -1 on failure.
+ */
+int setup_pollfds (int sox) {
+	if (allocate_pollfd (sox, POLLIN) != POLLIDX_LISTENER) {
+		return -1;
+	}
+	if (allocate_proxy (POLLIDX_LISTENER) != POLLIDX_LISTENER) {
+		return -1;
+	}
+	if (allocate_pollfd (resolve_fd (), POLLIN) != POLLIDX_RESOLVER) {
+		return -1;
+	}
+	if (allocate_proxy (POLLIDX_RESOLVER) != POLLIDX_RESOLVER) {
+		return -1;
+	}
+	return 0;
+}
+
+/* Prepare the mappings for use, by parsing their flags and setting up
+ * their shared token buckets.  Mappings to a hostname get a cache entry,
+ * whose lookup starts right away.  Labels with client address prefixes
+ * get their routes.  The longest busypoll time of the mappings bounds
+ * the spinning in low-latency mode.  Returns 0 on success, or -1 on error.
+ */
+int setup_mappings (struct mapping *maps) {
+	struct mapping *map = maps;
+	while (map) {
+		if (parse_mapping_flags (map) == -1) {
+			return -1;
+		}
+		tokenbucket_init (&map->mapbucket, map->maprate, map->mapburst, now);
+		if (map->busypoll * 1000ULL > spin_max) {
+			spin_max = map->busypoll * 1000ULL;
+			spin_budget = spin_max;
+		}
+		if (map->fwdhost != NULL) {
+			map->fwdcache = hostcache_get (map->fwdhost);
+			if (map->fwdcache == NULL) {
+				fprintf (stderr, "Failed to setup resolving %s for %s\n", map->fwdhost, map->label);
+				return -1;
+			}
+		}
+		map = map->next;
+	}
+	return setup_routes (maps);
+}
+
+/* Park a proxy side whose token buckets ran dry.  It stops polling for
+ * input until its wakeup time has come, and is then unparked by the
+ * daemon loop, which sets the poll() timeout to the earliest wakeup.
+ */
+void park_proxy (pollidx_t idx) {
+	proxies [idx].flags |= PROXY_PARKED;
+	proxies [idx].wakeup = shape_wakeup (proxies + idx);
+	polls [idx].events &= ~POLLIN;
+	trace_proxy (proxies + idx, TRACE_PARK, park, (proxies [idx].wakeup - now) / 1000);
+}
+
+/* Unpark a proxy side, so it polls for input again. */
+void unpark_proxy (pollidx_t idx) {
+	proxies [idx].flags &= ~PROXY_PARKED;
+	polls [idx].events |= POLLIN;
+}
+
+
+/* Determine the global connection cap, if it was not set with -m.
+ * Every connection takes two file descriptors, one for each side.
+ */
+void setup_maxcnx (void) {
+	struct rlimit rl;
+	if (setting_maxcnx != 0) {
+		// Set with -m
+	} else if ((getrlimit (RLIMIT_NOFILE, &rl) == -1) || (rl.rlim_cur == RLIM_INFINITY) || (rl.rlim_cur > 2 * (rlim_t) UINT16_MAX)) {
+		setting_maxcnx = UINT16_MAX;
+	} else if (rl.rlim_cur > RESERVED_FDS + 2) {
+		setting_maxcnx = (rl.rlim_cur - RESERVED_FDS) / 2;
+	} else {
+		setting_maxcnx = 1;
+	}
+	fprintf (stderr, "Accepting up to %u concurrent connections\n", setting_maxcnx);
+}
+
+/* Pause the listener, so it no longer accepts connections.  It resumes
+ * when the number of active connections drops to resume_at, or when a
+ * nonzero retry time has passed.  Resuming below the point of pausing
+ * avoids flapping between the two states under sustained load.
+ */
+void pause_listener (unsigned int resume_at, uint64_t retry) {
+	polls [POLLIDX_LISTENER].events &= ~POLLIN;
+	cnx_resume = resume_at;
+	listen_retry = retry;
+	if (!listen_paused) {
+		fprintf (stderr, "Pausing the listener at %u connections\n", cnx_active);
+		listen_paused = true;
+	}
+}
+
+/* Resume the listener after pause_listener(). */
+void resume_listener (void) {
+	polls [POLLIDX_LISTENER].events |= POLLIN;
+	listen_paused = false;
+	fprintf (stderr, "Resuming the listener at %u connections\n", cnx_active);
+}
+
+/* Refuse an incoming connection when out of file descriptors.  A spare
+ * file descriptor is released to make room to accept the connection and
+ * close it right away.  Without this, the listener would stay readable
+ * and the daemon loop would spin on failing accept() calls.
+ */
+void refuse_uplink (int sox) {
+	int cnx;
+	if (spare_fd != -1) {
+		struct in6_addr peer;
+		io->close (spare_fd);
+		cnx = io->accept (sox, &peer);
+		if (cnx != -1) {
+			io->close (cnx);
+		}
+		spare_fd = io->reserve ();
+	}
+	pause_listener ((cnx_active > 0) ? (cnx_active - 1) : 0, now + LISTEN_RETRY_NS);
+}
+
+
+/* Accept a new incoming connection, which counts as the uplink.
+ * While doing this, also ensure that a proxy structure has been allocated.
+ * In case of failure, resolve matters internally and report vigorously.
+ */
+void accept_uplink (int sox) {
+	int cnx;
+	int pfd;
+	struct in6_addr peer;
+	char peerstr [INET6_ADDRSTRLEN];
+	cnx = io->accept (sox, &peer);
+	if (cnx == -1) {
+		if ((errno == EMFILE) || (errno == ENFILE) || (errno == ENOBUFS) || (errno == ENOMEM)) {
+			perror ("Incoming connection refused for lack of resources");
+			refuse_uplink (sox);
+		} else if ((errno != EWOULDBLOCK) && (errno != EAGAIN)) {
+			perror ("Incoming connection refused");
+		}
+		return;
+	}
+	fprintf (stderr, "Accepted an incoming connection from upstream %s\n", inet_ntop (AF_INET6, &peer, peerstr, sizeof (peerstr)));
+	pfd = allocate_pollfd (cnx, POLLIN | POLLPRI | POLLRDHUP | POLLERR | POLLHUP | POLLNVAL);
+	if (pfd == INVALID_POLLIDX) {
+		fprintf (stderr, "Failed to allocate pollfd for accepted connection\n");
+		io->close (cnx);
+		return;
+	}
+	if (allocate_proxy (pfd) != pfd) {
+		fprintf (stderr, "Failed to allocate proxy for accepted connection\n");
+		free_pollfd (pfd);
+		io->close (cnx);
+		return;
+	}
+	init_upstream_proxy (proxies + pfd);
+	proxies [pfd].peeraddr = peer;
+	proxies [pfd].cnxid = cnx_counter++;
+	trace_sample (proxies + pfd);
+	trace_proxy (proxies + pfd, TRACE_ACCEPT, accept, cnx);
+	//
+	// Stop accepting when the global connection cap is reached
+	//
+	if (++cnx_active >= setting_maxcnx) {
+		pause_listener (setting_maxcnx - 1 - setting_maxcnx / 10, 0);
+	}
+	fprintf (stderr, "Successful accept_uplink () -- polls_used=%d, proxies_used=%d\n", polls_used, proxies_used);
+}
+
+/* Connect a client socket for a single connection.
+ * Returns 0 for success, or -1 for failure (and sets errno).
+ * When the downlink hostname is still being looked up, this fails
+ * with EINPROGRESS; it is called again when the lookup completes.
+ */
+int connect_downlink (pollidx_t idx, uint8_t *label, size_t labellen) {
+	int sox2;
+	int idx2;
+	struct in6_addr *fwdaddr = NULL;
+	struct mapping *map = mappings;
+	printf ("Connection has label %.*s\n", labellen, label);
+	//
+	// Lookup the map entry with this label
+	//
+	while (map) {
+		if ((memcmp (map->label, label, labellen) == 0) && (map->label [labellen] == 0)) {
+			break;
+		}
+		map = map->next;
+	}
+	if (!map) {
+		errno = ENOKEY;
+		return -1;
+	}
+	//
+	// Route on the client address, if the label has prefixes
+	//
+	if (map->routes != NULL) {
+		map = route_lookup (map->routes, &proxies [idx].peeraddr);
+		if (!map) {
+			errno = EACCES;
+			return -1;
+		}
+	}
+	//
+	// Refuse the connection when the map has no slots left, and
+	// otherwise assign the map to the existing upstream side.
+	// This was already done when retrying after a lookup.
+	//
+	if (proxies [idx].proxymap != map) {
+		if ((map->maxcnx != 0) && (map->cnx_active >= map->maxcnx)) {
+			fprintf (stderr, "Mapping %s is at its maximum of %u connections\n", map->label, map->maxcnx);
+			errno = EUSERS;
+			return -1;
+		}
+		proxies [idx].proxymap = map;
+		map->cnx_active++;
+		if (map->busypoll != 0) {
+			cnx_busypoll++;
+		}
+	}
+	//
+	// Find the address of the downstream remote endpoint
+	//
+	if (map->fwdcache != NULL) {
+		fwdaddr = hostcache_addr (map->fwdcache);
+		if (fwdaddr == NULL) {
+			return -1;
+		}
+	} else {
+		fwdaddr = &map->fwdaddr;
+	}
+	//
+	// Connect to the downstream remote endpoint
+	//
+	printf ("Connecting service to downlink\n");
+	sox2 = io->connect (fwdaddr, map->fwdport);
+	if (sox2 == -1) {
+		return -1;
+	}
+	fprintf (stderr, "Connected to downstream service for %.*s\n", labellen, label);
+	//
+	// Create the new pollfd and proxy structures
+	//
+	// Since this is a new connection, created because the first TLS record
+	// is to be shipped there, it is setup with both the POLLIN flag and
+	// POLLOUT flag set; POLLIN indicates that its own proxy side is ready
+	// to receive data, POLLOUT indicates that the peer which finished
+	// processing the first TLS record is in the mode to pass that on.
+	//
+	// On failure, the upstream side at idx is left for the caller to
+	// shutdown, so its connection counts are released along with it.
+	//
+	idx2 = allocate_pollfd (sox2, POLLOUT | POLLIN | POLLPRI | POLLRDHUP | POLLERR | POLLHUP | POLLNVAL);
+	if (idx2 == INVALID_POLLIDX) {
+		fprintf (stderr, "Closing down failing connections (no pollfd)\n");
+		io->close (sox2);
+		errno = ENOMEM;
+		return -1;
+	}
+	if (allocate_proxy (idx2) != idx2) {
+		fprintf (stderr, "Closing down failing connections (no proxy)\n");
+		io->close (sox2);
+		free_pollfd (idx2);
+		errno = ENOMEM;
+		return -1;
+	}
+	//
+	// Setup proxymap, peeridx and flags values for this second side
+	//
+	proxies [idx2].proxymap = map;
+	proxies [idx2].peeridx = idx ;
+	proxies [idx ].peeridx = idx2;
+	init_dnstream_proxy (proxies + idx2);
+	proxies [idx2].flags |= proxies [idx].flags & PROXY_TRACED;
+	proxies [idx2].cnxid = proxies [idx].cnxid;
+	proxies [idx2].since = proxies [idx].since;
+	trace_proxy (proxies + idx, TRACE_CONNECT, connect, map->fwdport);
+	shape_init_proxy (proxies + idx , now);
+	shape_init_proxy (proxies + idx2, now);
+	//
+	// Setup low-latency mode on both sides; without privileges, the
+	// busy polling may fail but the rest still applies to both sides,
+	// and the daemon still spins
+	//
+	if (map->busypoll != 0) {
+		int failure = 0;
+		if (io->lowlatency (polls [idx].fd, map->busypoll) == -1) {
+			failure = errno;
+		}
+		if (io->lowlatency (sox2, map->busypoll) == -1) {
+			failure = errno;
+		}
+		if ((failure != 0) && !busypoll_warned) {
+			errno = failure;
+			perror ("Failed to setup busy polling on sockets");
+			busypoll_warned = true;
+		}
+	}
+	fprintf (stderr, "Successful connect_downlink () -- polls_used=%d, proxies_used=%d\n", polls_used, proxies_used);
+	return 0;
+}
+
+/* Shutdown one side of the proxy communication link.
+ *
+ * This starts by shutting down the peer, if any.  Freeing the peer may
+ * move the last pollfd into its place; if that was this side, then it
+ * continues from the peer's former index.
+ */
+void shutdown_proxy (pollidx_t idx) {
+	pollidx_t peeridx = proxies [idx].peeridx;
+	trace_proxy (proxies + idx, TRACE_SHUTDOWN, shutdown, proxy_side_upstream (proxies + idx));
+	if (peeridx != INVALID_POLLIDX) {
+		proxies [peeridx].peeridx = INVALID_POLLIDX;
+		shutdown_proxy (peeridx);
+		if (idx == polls_used) {
+			idx = peeridx;
+		}
+	}
+	//
+	// The upstream side holds the connection counts
+	//
+	if (proxy_side_upstream (proxies + idx)) {
+		if (proxies [idx].proxymap != NULL) {
+			proxies [idx].proxymap->cnx_active--;
+			if (proxies [idx].proxymap->busypoll != 0) {
+				cnx_busypoll--;
+			}
+		}
+		cnx_active--;
+		if (listen_paused && (cnx_active <= cnx_resume)) {
+			resume_listener ();
+		}
+	}
+	io->close (polls [idx].fd);
+	free_pollfd (idx);
+	free_proxy (idx);
+	fprintf (stderr, "Successful shutdown_proxy () -- polls_used=%d, proxies_used=%d\n", polls_used, proxies_used);
+}
+
+
+/* The first TLS record is received over a proxy with an invalid peeridx.
+ * When this arrives, scan for the label and use it to connect to the
+ * other end of the requested connection, or set this one to error mode.
+ * Return -1 on error, or 0 on success.
+ */
+int process_record1 (pollidx_t idx) {
+	uint8_t *label = NULL;
+	size_t labellen;
+	bool error = true;
+	assert (proxies [idx].peeridx == INVALID_POLLIDX);
+	if (!proxy_sends (proxies + idx)) {
+		return -1;
+	}
+	record_label (proxies [idx].rdbuf, proxies [idx].read, &label, &labellen);
+	if (label) {
+		trace_proxy_label (proxies + idx, label, labellen);
+		if (connect_downlink (idx, label, labellen) != -1) {
+			error = false;
+		} else if (errno == EINPROGRESS) {
+			// Hold the record until the lookup completes
+			proxies [idx].flags |= PROXY_RESOLVING;
+			error = false;
+		} else {
+			perror ("Failure connecting downstream");
+		}
+	} else {
+		printf ("DID NOT find a label, will shutdown upstream\n");
+	}
+	if (error) {
+		trace_proxy (proxies + idx, TRACE_REFUSE, refuse, label ? errno : 0);
+		set_proxymode (proxies + idx, PROXY_MODE_ERROR);
+		return -1;
+	} else {
+		return 0;
+	}
+}
+
+/* Retry the connections that waited for a completed lookup.  This runs
+ * downward, so proxies that move down after a shutdown were seen before.
+ */
+void retry_resolving (struct hostcache *hc) {
+	pollidx_t idx = polls_used;
+	while (idx-- > POLLIDX_PROXIES) {
+		if (!proxy_resolving (proxies + idx) || (proxies [idx].proxymap->fwdcache != hc)) {
+			continue;
+		}
+		proxies [idx].flags &= ~PROXY_RESOLVING;
+		if (process_record1 (idx) == -1) {
+			shutdown_proxy (idx);
+		}
+	}
+}
+
+/* Wait for events on the pollfd structures, as poll() does.
+ *
+ * While connections in low-latency mode are active, this first spins
+ * with non-blocking polls, to avoid the wakeup latency of sleeping.  The
+ * spin time adapts to the traffic, as in the halt-polling of KVM: when
+ * events arrive soon after spinning ended, a longer spin would have seen
+ * them, so it grows, up to the longest busypoll time; when they take
+ * longer than that, spinning was wasted, so it shrinks.  The time spent
+ * spinning counts towards the timeout.
+ */
+int wait_events (int timeout) {
+	uint64_t start, spun, blocked;
+	int ready;
+	if ((cnx_busypoll == 0) || (timeout == 0)) {
+		return io->poll (polls, polls_used, timeout);
+	}
+	start = io->clock ();
+	do {
+		ready = io->poll (polls, polls_used, 0);
+		if (ready != 0) {
+			return ready;
+		}
+		sched_yield ();
+		spun = io->clock () - start;
+	} while (spun < spin_budget);
+	if (timeout > 0) {
+		timeout -= spun / 1000000;
+		if (timeout < 0) {
+			timeout = 0;
+		}
+	}
+	ready = io->poll (polls, polls_used, timeout);
+	blocked = io->clock () - start - spun;
+	if (ready <= 0) {
+		// Timeouts and signals say nothing about the traffic
+	} else if (blocked < spin_max) {
+		spin_budget = (spin_budget * 2 < spin_max) ? (spin_budget * 2) : spin_max;
+	} else {
+		spin_budget = (spin_budget / 2 > SPIN_MIN_NS) ? (spin_budget / 2) : SPIN_MIN_NS;
+	}
+	return ready;
+}
+
+/* Daemon control loop */
+void daemon_loop (void) {
+	int timeout = -1;
+	unsigned int rotate = 0;
+	while (!interrupted) {
+		int ctr;
+		uint64_t wakeup = UINT64_MAX;
+		int ready = wait_events (timeout);
+		int poll_errno = errno;
+		//
+		// A signal may have asked for a trace, either during poll()
+		// or while processing events in the previous iteration
+		//
+		if (trace_requested) {
+			trace_requested = 0;
+			trace_dump (stderr);
+		}
+		if (ready == -1) {
+			if (poll_errno != EINTR) {
+				errno = poll_errno;
+				perror ("Failed to poll");
+				break;
+			}
+			continue;
+		}
+		now = io->clock ();
+		//
+		// Process new incoming connections on the server socket
+		//
+		if (polls [POLLIDX_LISTENER].revents & POLLIN) {
+			accept_uplink (polls [POLLIDX_LISTENER].fd);
+			polls [POLLIDX_LISTENER].revents &= ~POLLIN;
+		}
+		//
+		// Continue connections whose downlink hostname was resolved
+		//
+		if (polls [POLLIDX_RESOLVER].revents & POLLIN) {
+			resolve_complete (retry_resolving);
+			polls [POLLIDX_RESOLVER].revents &= ~POLLIN;
+		}
+		//
+		// Retry accepting after running out of file descriptors
+		//
+		if (listen_paused && (listen_retry != 0)) {
+			if (listen_retry <= now) {
+				resume_listener ();
+			} else {
+				wakeup = listen_retry;
+			}
+		}
+		//
+		// Iterate over proxy sockets and process events
+		//
+		// The starting point rotates, so proxy sides that share
+		// the token bucket of a mapping take turns in being the
+		// first to draw from it.
+		//
+		rotate++;
+		for (ctr = 0; ctr + POLLIDX_PROXIES < polls_used; ctr++) {
+			int idx = POLLIDX_PROXIES + (rotate + ctr) % (polls_used - POLLIDX_PROXIES);
+			//
+			// Process errors, if any
+			//
+			// After a shutdown, another pollfd may have moved
+			// into idx.  Its events are skipped until the next
+			// poll() reports them again.
+			//
+			if (polls [idx].revents & (POLLRDHUP | POLLERR | POLLHUP | POLLNVAL)) {
+				shutdown_proxy (idx);
+				continue;
+			}
+			//
+			// Process any incoming data
+			//
+			// This is not really complex; the proxy side and the
+			// incoming file descriptor are found at the same
+			// index.  So the pollfd's file descriptor and the
+			// rdbuf, read, written values all reside in the
+			// pollfd and proxies structures at idx.
+			//
+			// Reading is limited by the token buckets, and
+			// the proxy side is parked when they are empty.
+			//
+			if (polls [idx].revents & POLLIN) {
+				size_t allowed = shape_allowance (proxies + idx, now, MAXRECLEN);
+				if (proxies [idx].read == 0) {
+					proxies [idx].rxstamp = now;
+				}
+				if (allowed == 0) {
+					park_proxy (idx);
+					polls [idx].revents &= ~POLLIN;
+				} else {
+					shape_charge (proxies + idx, recv_record (polls [idx].fd, proxies + idx, allowed));
+				}
+				// Done receiving on this proxy side?
+				if (!proxy_recvs (proxies + idx)) {
+					polls [idx].events &= ~POLLIN;
+					// Ended in error on this proxy side?
+					if (!proxy_sends (proxies + idx)) {
+						shutdown_proxy (idx);
+						continue;
+					// ...or sending the first TLS record?
+					} else if (proxies [idx].peeridx == INVALID_POLLIDX) {
+						// Construct peer, with POLLOUT
+						if (process_record1 (idx) == -1) {
+							shutdown_proxy (idx);
+							continue;
+						}
+					// ...or sending a further TLS record?
+					} else {
+						// Setup sending in the peer
+						polls [proxies [idx].peeridx].events |= POLLOUT;
+					}
+				}
+			}
+			//
+			// Process any opportunity to send.
+			//
+			// POLLOUT is possible if the peer's proxy state is
+			// currently sending (so, not receiving).  The data
+			// (rdbuf, read, written) is found at the peer, and
+			// the only thing found at the current index is the
+			// POLLOUT event on this side's file descriptor.
+			//
+			if (polls [idx].revents & POLLOUT) {
+				pollidx_t origin = proxies [idx].peeridx;
+				send_record (polls [idx].fd, proxies + origin);
+				// Done sending from the peer proxy side?
+				if (!proxy_sends (proxies + origin)) {
+					polls [idx].events &= ~POLLOUT;
+					// Was this the ClientHello?
+					if (proxy_side_upstream (proxies + origin) && !(proxies [origin].flags & PROXY_HELLO_SENT)) {
+						proxies [origin].flags |= PROXY_HELLO_SENT;
+						trace_proxy (proxies + origin, TRACE_HELLO_SENT, hello_sent, proxy_recvs (proxies + origin));
+					// ...or a further record that was relayed?
+					} else if (proxy_recvs (proxies + origin)) {
+						trace_latency (proxies + origin, io->clock ());
+					}
+					// Now receiving on the peer proxy side?
+					if (proxy_recvs (proxies + origin)) {
+						polls [origin].events |= POLLIN;
+					// ...or did it end in error?
+					} else {
+						shutdown_proxy (origin);
+						continue;
+					}
+				}
+			}
+			//
+			// Clear the events, so they are not processed again
+			// if this pollfd moves to a later index
+			//
+			polls [idx].revents = 0;
+		}
+		//
+		// Unpark proxy sides whose token buckets have refilled, and
+		// wait no longer than the first that remains parked.
+		//
+		// This scans all proxy sides after the event pass, because
+		// shutdowns during the pass move entries around, so that
+		// the pass may not visit every one of them.
+		//
+		for (ctr = POLLIDX_PROXIES; ctr < polls_used; ctr++) {
+			if (!proxy_parked (proxies + ctr)) {
+				continue;
+			}
+			if (proxies [ctr].wakeup <= now) {
+				unpark_proxy (ctr);
+			} else if (proxies [ctr].wakeup < wakeup) {
+				wakeup = proxies [ctr].wakeup;
+			}
+		}
+		if (wakeup == UINT64_MAX) {
+			timeout = -1;
+		} else if (wakeup <= now) {
+			timeout = 0;
+		} else {
+			timeout = (int) ((wakeup - now + 999999) / 1000000);
+		}
+	}
+	//
+	// Coming here, the daemon was interrupted by a signal
+	//
+	if (interrupted) {
+		fprintf (stderr, "\nInterrupted\n");
+	}
+}
+
+/* Cleanup by closing any open sockets */
+void cleanup (void) {
+	if (polls) {
+		int idx;
+		for (idx = polls_used-1; idx >= 0; idx--) {
+			// The resolver pipe is not ours, the thread still writes it
+			if ((polls [idx].fd != -1) && (idx != POLLIDX_RESOLVER)) {
+				io->close (polls [idx].fd);
+			}
+		}
+		free (polls);
+		polls = NULL;
+	}
+	if (proxies) {
+		free (proxies);
+		proxies = NULL;
+	}
+	if (spare_fd != -1) {
+		io->close (spare_fd);
+		spare_fd = -1;
+	}
+	fprintf (stderr, "Cleaned up sockets, freed memory for polls and proxies\n");
+}
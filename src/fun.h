@@ -12,12 +12,126 @@ typedef unsigned int pollidx_t;
 #define INVALID_POLLIDX ((pollidx_t) -1)
 
 
-/* A configured mapping, labeled and with a particular downlink. */
+/* A token bucket for bandwidth shaping.  The rate is in bytes per
+ * second, with 0 meaning unlimited; the burst is the bucket depth in
+ * bytes.  Times are in nanoseconds from shape_clock().
+ */
+struct tokenbucket {
+	uint32_t rate, burst;
+	uint64_t fillns;
+	uint64_t tokens;
+	uint64_t stamp;
+};
+
+/* A parked proxy side waits until it may read this many bytes. */
+#define SHAPE_QUANTUM 4096
+
+
+/* USDT probes for perf and bpftrace, if the system supports them */
+#if defined (__has_include)
+#if __has_include (<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SYS_SDT_H 1
+#endif
+#endif
+
+#ifdef HAVE_SYS_SDT_H
+#define TRACE_PROBE(name,cnxid,arg) DTRACE_PROBE2 (snitch, name, cnxid, arg)
+#define TRACE_PROBE_LABEL(cnxid,lbl,lbllen) DTRACE_PROBE3 (snitch, label, cnxid, lbl, lbllen)
+#else
+#define TRACE_PROBE(name,cnxid,arg)
+#define TRACE_PROBE_LABEL(cnxid,lbl,lbllen)
+#endif
+
+/* Lifecycle stages of a connection, as logged in the event ring */
+#define TRACE_ACCEPT		1
+#define TRACE_LABEL		2
+#define TRACE_CONNECT		3
+#define TRACE_HELLO_SENT	4
+#define TRACE_PARK		5
+#define TRACE_REFUSE		6
+#define TRACE_SHUTDOWN		7
+
+/* Relay latencies are kept for connections in normal and low-latency mode */
+#define LATENCY_NORMAL		0
+#define LATENCY_BUSYPOLL	1
+
+/* Trace a lifecycle stage of a proxy side, with a USDT probe and, for
+ * sampled connections, an entry in the event ring.
+ */
+#define trace_proxy(pxy,evt,name,arg) { \
+	TRACE_PROBE (name, (pxy)->cnxid, (arg)); \
+	if ((pxy)->flags & PROXY_TRACED) { \
+		trace_event ((pxy), (evt), (arg)); \
+	} \
+}
+
+/* Trace the label found in the ClientHello of a proxy side.  The probe
+ * passes the label and its length, and the ring keeps a copy, so the
+ * connections of a tenant can be told apart.
+ */
+#define trace_proxy_label(pxy,lbl,lbllen) { \
+	TRACE_PROBE_LABEL ((pxy)->cnxid, (lbl), (lbllen)); \
+	if ((pxy)->flags & PROXY_TRACED) { \
+		trace_event_label ((pxy), (lbl), (lbllen)); \
+	} \
+}
+
+
+/* A cached hostname lookup, as made by the resolver in resolve.c.
+ * The address is valid until expires, and may be used while it is
+ * looked up again until stale_until.  A name that does not resolve
+ * is not valid, which is cached until expires as well.  The res_
+ * fields pass a result from the resolver thread, under its lock.
+ */
+struct hostcache {
+	struct hostcache *next;
+	char *name;
+	struct in6_addr addr;
+	bool valid, pending;
+	uint64_t expires, stale_until;
+	struct hostcache *qnext;
+	int res_result;
+	struct in6_addr res_addr;
+	uint32_t res_ttl;
+};
+
+
+/* An address prefix of clients, with IPv4 mapped into IPv6. */
+struct addrprefix {
+	struct in6_addr addr;
+	uint8_t len;
+};
+
+/* A compiled table for routing on client addresses, see route.c */
+struct routetable;
+
+
+/* A configured mapping, labeled and with a particular downlink.
+ * The downlink is either an address, or a hostname that is resolved
+ * through a hostcache entry when setup_mappings() sets fwdcache.
+ * The flags are the words following the port in the configuration;
+ * they are parsed into the remaining fields by setup_mappings().
+ * A label may have several mappings for clients from different address
+ * prefixes; they share the routes that setup_mappings() compiles.
+ */
 struct mapping {
 	struct mapping *next;
 	char *label;
 	struct in6_addr fwdaddr;
 	uint16_t fwdport;
+	char *flags;
+	char *fwdhost;
+	struct hostcache *fwdcache;
+	uint32_t maprate, mapburst;
+	uint32_t cnxrate, cnxburst;
+	struct tokenbucket mapbucket;
+	uint32_t maxcnx;
+	uint32_t busypoll;
+	unsigned int cnx_active;
+	struct addrprefix *from;
+	unsigned int from_count;
+	struct routetable *routes;
 };
 
 #define MAXRECLEN (5 + 16384)
@@ -29,6 +143,13 @@ struct mapping {
 
 #define PROXY_SIDE_UPSTREAM	0x0010
 
+#define PROXY_PARKED		0x0020
+
+#define PROXY_TRACED		0x0040
+#define PROXY_HELLO_SENT	0x0080
+
+#define PROXY_RESOLVING		0x0100
+
 #define set_proxymode(pxy,m) (((pxy)->flags = ((pxy)->flags & ~PROXY_MODE_MASK) | (m)))
 #define proxymode(pxy,m) ((pxy)->flags & ~PROXY_MODE_MASK)
 
@@ -40,6 +161,16 @@ struct mapping {
 #define proxy_fails(pxy) (((pxy)->flags & PROXY_MODE_MASK) == PROXY_MODE_ERROR)
 #define proxy_side_upstream(pxy) (((pxy)->flags & PROXY_SIDE_UPSTREAM) == PROXY_SIDE_UPSTREAM)
 #define proxy_side_dnstream(pxy) (((pxy)->flags & PROXY_SIDE_UPSTREAM) != PROXY_SIDE_UPSTREAM)
+#define proxy_parked(pxy) (((pxy)->flags & PROXY_PARKED) == PROXY_PARKED)
+#define proxy_resolving(pxy) (((pxy)->flags & PROXY_RESOLVING) == PROXY_RESOLVING)
+
+
+/* The first pollfd entries have a fixed purpose; proxies follow them.
+ * The resolver entry has fd -1 until a hostname needs resolving.
+ */
+#define POLLIDX_LISTENER	0
+#define POLLIDX_RESOLVER	1
+#define POLLIDX_PROXIES		2
 
 
 /* The structure of a one-sided proxy, upstream & downstream.
@@ -65,6 +196,20 @@ struct mapping {
  *
  * Note that in initial and terminal stages, it is possible that peerdix
  * values are set to INVALID_POLLFD.
+ *
+ * A proxy side whose token buckets ran dry is parked; it has POLLIN
+ * removed from its pollfd until the wakeup time has passed.
+ *
+ * A proxy side whose downlink hostname is being looked up is resolving;
+ * it holds its first record until the lookup completes.
+ *
+ * Both sides of a connection share its cnxid, which identifies it in
+ * traces.  Sampled connections are traced from the time since.
+ *
+ * The upstream side holds the client address in peeraddr.
+ *
+ * A proxy side that started reading a record at time rxstamp reports
+ * the relay latency of the record when it has been passed on.
  */
 struct proxy {
 	struct mapping *proxymap;
@@ -72,16 +217,99 @@ struct proxy {
 	uint16_t flags;
 	uint8_t rdbuf [MAXRECLEN];
 	size_t read, written;
+	struct tokenbucket cnxbucket;
+	uint64_t wakeup;
+	uint32_t cnxid;
+	uint64_t since;
+	struct in6_addr peeraddr;
+	uint64_t rxstamp;
+};
+
+
+/* The I/O backend used by the daemon.  Normal operation uses io_posix,
+ * the simulator in sim.c replaces it to run without a network.  The
+ * functions follow their POSIX namesakes, except that accept() returns
+ * a non-blocking socket and the client address in IPv6 form, connect()
+ * creates the non-blocking socket that it connects, and clock() returns
+ * monotonic time in nanoseconds.  The reserve() function opens a spare
+ * file descriptor, which is released with close() when the daemon runs
+ * out of them.  The lowlatency() function prepares a
+ * socket for low-latency mode, with busy polling for a number of
+ * microseconds; it returns 0 on success or -1 on failure.
+ */
+struct iobackend {
+	int (*accept) (int sox, struct in6_addr *peer);
+	int (*connect) (struct in6_addr *addr, uint16_t port);
+	ssize_t (*read) (int fd, void *buf, size_t len);
+	ssize_t (*write) (int fd, const void *buf, size_t len);
+	int (*close) (int fd);
+	int (*reserve) (void);
+	int (*poll) (struct pollfd *fds, nfds_t nfds, int timeout);
+	uint64_t (*clock) (void);
+	int (*lowlatency) (int fd, uint32_t usec);
 };
 
 
+/********** GLOBALS **********/
+
+
+/* Settings, defined along with the main program */
+extern unsigned int setting_maxcnx;
+extern unsigned int setting_tracesample;
+extern char *setting_hostsfile;
+extern char *setting_nameserver;
+
+/* Daemon state, defined in daemon.c */
+extern volatile sig_atomic_t interrupted;
+extern volatile sig_atomic_t trace_requested;
+extern uint64_t now;
+extern unsigned int cnx_active;
+extern int spare_fd;
+extern struct pollfd *polls;
+extern pollidx_t polls_used;
+extern struct proxy *proxies;
+extern struct mapping *mappings;
+
+/* The I/O backends, defined in io.c */
+extern struct iobackend io_posix;
+extern struct iobackend *io;
+
+
 /********** FUNCTIONS **********/
 
 
-/* Receive a TLS record or part of it from the proxy.
- * Updates the proxy to write state when complete.
+/* Allocate a polling entry; return INVALID_POLLIDX on failure. */
+pollidx_t allocate_pollfd (int fd, short events);
+
+/* Allocate a proxy entry for a given pollidx_t value, return -1 on failure. */
+int allocate_proxy (pollidx_t idx);
+
+/* Setup the fixed pollfd entries and their proxies, for the listener
+ * and the resolver.  Returns 0 on success, or -1 on failure.
  */
-void recv_record (int sox, struct proxy *pxy);
+int setup_pollfds (int sox);
+
+/* Prepare the mappings for use.  Returns 0 on success, or -1 on error. */
+int setup_mappings (struct mapping *map);
+
+/* Determine the global connection cap, if it was not set explicitly. */
+void setup_maxcnx (void);
+
+/* Daemon control loop */
+void daemon_loop (void);
+
+/* Cleanup by closing any open sockets */
+void cleanup (void);
+
+/* Portable function to set a socket into non-blocking mode. */
+void socket_unblock (int sox);
+
+
+/* Receive a TLS record or part of it from the proxy, but no more
+ * than maxlen bytes.  Updates the proxy to write state when complete.
+ * Returns the number of bytes read.
+ */
+size_t recv_record (int sox, struct proxy *pxy, size_t maxlen);
 
 /* Write a TLS record (or part of it) to the peering proxy.
  * Updates the proxy to read state when complete.
@@ -89,6 +317,71 @@ void recv_record (int sox, struct proxy *pxy);
 void send_record (int sox, struct proxy *pxy);
 
 /* Fetch the label contained in the first TLS record */
-void record1_label (uint8_t *recbuf, size_t recbuflen, uint8_t **label, size_t *labellen);
+void record_label (uint8_t *recbuf, size_t recbuflen, uint8_t **label, size_t *labellen);
+
+/* Return the current time in nanoseconds on a monotonic clock. */
+uint64_t shape_clock (void);
+
+/* Setup a token bucket; a rate of 0 means unlimited. */
+void tokenbucket_init (struct tokenbucket *tb, uint32_t rate, uint32_t burst, uint64_t now);
+
+/* Return how many of the wanted bytes the bucket currently permits. */
+size_t tokenbucket_allow (struct tokenbucket *tb, uint64_t now, size_t want);
+
+/* Consume tokens for bytes that passed through. */
+void tokenbucket_take (struct tokenbucket *tb, size_t used);
+
+/* Return the time at which the bucket holds at least one quantum. */
+uint64_t tokenbucket_wakeup (struct tokenbucket *tb);
+
+/* Setup the per-connection bucket for a proxy side from its mapping. */
+void shape_init_proxy (struct proxy *pxy, uint64_t now);
+
+/* Return the number of bytes a proxy side may read now, at most want. */
+size_t shape_allowance (struct proxy *pxy, uint64_t now, size_t want);
+
+/* Charge the bytes read by a proxy side to its token buckets. */
+void shape_charge (struct proxy *pxy, size_t used);
+
+/* Return the time at which a parked proxy side may read again. */
+uint64_t shape_wakeup (struct proxy *pxy);
+
+/* Decide whether a new connection is sampled for the event ring. */
+void trace_sample (struct proxy *pxy);
+
+/* Log an event for a traced proxy into the ring. */
+void trace_event (struct proxy *pxy, uint16_t event, uint32_t arg);
+
+/* Log the label of a traced proxy into the ring. */
+void trace_event_label (struct proxy *pxy, uint8_t *label, size_t labellen);
+
+/* Dump the ring of events, oldest first, and the relay latencies. */
+void trace_dump (FILE *out);
+
+/* Record the relay latency of a record that a proxy side passed on. */
+void trace_latency (struct proxy *pxy, uint64_t passed);
+
+/* Parse a client address prefix; returns true on success. */
+bool route_parse_prefix (char *str, size_t len, struct addrprefix *pfx);
+
+/* Setup routing for the labels that have mappings with from= flags. */
+int setup_routes (struct mapping *maps);
+
+/* Return the mapping to use for a client address, or NULL if none. */
+struct mapping *route_lookup (struct routetable *rt, struct in6_addr *client);
+
+/* Find or add the cache entry for a hostname, and start looking it up. */
+struct hostcache *hostcache_get (char *name);
+
+/* Ask the resolver thread to lookup a cache entry, unless it already is. */
+void resolve_request (struct hostcache *hc);
+
+/* Return the file descriptor on which lookups complete, or -1. */
+int resolve_fd (void);
+
+/* Process completed lookups, passing each to a retry callback. */
+void resolve_complete (void (*retry) (struct hostcache *hc));
 
+/* Return the address to use for a cache entry, or NULL with errno set. */
+struct in6_addr *hostcache_addr (struct hostcache *hc);
 
@@ -0,0 +1,160 @@
+/* snitch/io.c -- The I/O backend that connects the daemon to the system.
+ *
+ * The daemon does not call the socket functions directly, but through
+ * the io backend pointer.  This normally points to io_posix, defined
+ * below, but the simulator in sim.c substitutes its own backend to run
+ * the proxy state machine without a network.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "fun.h"
+
+
+/* Portable function to set a socket into non-blocking mode.  This is a
+ * requirement for asynchronous communication, especially for the accept()
+ * function which could block if an attempted setup is torn down between
+ * noticing the acticity on the socket and the invocation of accept().
+ *
+ * Source: http://www.kegel.com/dkftpbench/nonblocking.html
+ * Credit: Bjorn Reese
+ */
+void socket_unblock (int sox) {
+	int retval;
+#ifdef O_NONBLOCK
+	int flags;
+	// Fix: O_NONBLOCK is defined but broken on SunOS 4.1.x and AIX 3.2.5.
+	flags = fcntl (sox, F_GETFL, 0);
+	if (flags == -1) {
+		flags = 0;
+		fprintf (stderr, "socket_unblock() may expose a bug on SunOS 4.1.x and AIX 3.2.5\n");
+	}
+	// We have O_NONBLOCK, so we use the Posix way to do it
+	retval = fcntl (sox, F_SETFL, flags | O_NONBLOCK);
+#else
+	// In lieu of O_NONBLOCK, we use the old way of doing it
+	flags = 1;
+	retval = ioctl (sox, FIOBIO, &flags);
+#endif
+	if (retval == -1) {
+		fprintf (stderr, "Failed to set socket %d to non-blocking mode.  Race conditions could occur!\n", sox);
+	}
+}
+
+
+/* Accept a connection and make it non-blocking.  The listener is an
+ * IPv6 socket, so IPv4 clients have IPv4-mapped addresses.
+ */
+static int posix_accept (int sox, struct in6_addr *peer) {
+	struct sockaddr_in6 sa;
+	socklen_t salen = sizeof (sa);
+	int cnx = accept (sox, (struct sockaddr *) &sa, &salen);
+	if (cnx != -1) {
+		socket_unblock (cnx);
+		if (sa.sin6_family == AF_INET6) {
+			memcpy (peer, &sa.sin6_addr, 16);
+		} else {
+			memset (peer, 0, 16);
+		}
+	}
+	return cnx;
+}
+
+/* Connect to a downstream address and port, and make it non-blocking.
+ * Returns the new socket, or -1 for failure (and sets errno).
+ */
+static int posix_connect (struct in6_addr *addr, uint16_t port) {
+	int sox;
+	struct sockaddr_in6 sa;
+	sox = socket (AF_INET6, SOCK_STREAM, 0);
+	if (sox == -1) {
+		return -1;
+	}
+	memset (&sa, 0, sizeof (sa));
+	sa.sin6_family = AF_INET6;
+	memcpy (&sa.sin6_addr, addr, 16);
+	sa.sin6_port = htons (port);
+	if (connect (sox, (struct sockaddr *) &sa, sizeof (sa)) == -1) {
+		close (sox);
+		return -1;
+	}
+	socket_unblock (sox);
+	return sox;
+}
+
+static ssize_t posix_read (int fd, void *buf, size_t len) {
+	return read (fd, buf, len);
+}
+
+static ssize_t posix_write (int fd, const void *buf, size_t len) {
+	return write (fd, buf, len);
+}
+
+static int posix_close (int fd) {
+	return close (fd);
+}
+
+static int posix_reserve (void) {
+	return open ("/dev/null", O_RDONLY);
+}
+
+static int posix_poll (struct pollfd *fds, nfds_t nfds, int timeout) {
+	return poll (fds, nfds, timeout);
+}
+
+/* Prepare a socket for low-latency mode.  Small records are sent without
+ * delay, and reading busy polls the device queue for usec microseconds,
+ * in preference over interrupts, before sleeping.  Busy polling beyond
+ * net.core.busy_read requires CAP_NET_ADMIN.
+ */
+static int posix_lowlatency (int fd, uint32_t usec) {
+	int one = 1;
+	int busy = usec;
+	int retval = 0;
+	if (setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one)) == -1) {
+		retval = -1;
+	}
+#ifdef SO_BUSY_POLL
+	if (setsockopt (fd, SOL_SOCKET, SO_BUSY_POLL, &busy, sizeof (busy)) == -1) {
+		retval = -1;
+	}
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+	if (setsockopt (fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof (one)) == -1) {
+		retval = -1;
+	}
+#endif
+	return retval;
+}
+
+
+/* The backend for normal operation, and the one currently in use */
+struct iobackend io_posix = {
+	posix_accept,
+	posix_connect,
+	posix_read,
+	posix_write,
+	posix_close,
+	posix_reserve,
+	posix_poll,
+	shape_clock,
+	posix_lowlatency,
+};
+
+struct iobackend *io = &io_posix;
@@ -0,0 +1,287 @@
+/* snitch/latency.c -- Measure the latency that the SNItch adds to records.
+ *
+ * This program plays both a client and the backend server of a mapping.
+ * It sends small TLS records back and forth, one at a time, and measures
+ * the round trip time of each.  It does this directly to its own backend
+ * and then through the SNItch, so the difference between the two is the
+ * latency added by relaying each record in both directions.  Run it for
+ * a mapping with and without the busypoll flag to see what low-latency
+ * mode gains.
+ *
+ * The backend listens on the port of the mapping, so the mapping should
+ * point at this host.  For example, with a configuration line
+ *
+ *	ssh.snitch ::1 2222 busypoll=50
+ *
+ * the measurement would be
+ *
+ *	./snitch-latency -l ssh.snitch -b 2222 -n 100000
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+
+/* Measurement settings */
+struct in6_addr latency_addr = IN6ADDR_LOOPBACK_INIT;
+uint16_t latency_port = 4433;
+uint16_t latency_backend = 0;
+char *latency_label = NULL;
+unsigned int latency_count = 10000;
+unsigned int latency_size = 64;
+
+
+/* Return the current time in nanoseconds on a monotonic clock */
+static uint64_t latency_clock (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec) * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+/* Read exactly len bytes, or return false */
+static bool read_all (int sox, uint8_t *buf, size_t len) {
+	while (len > 0) {
+		ssize_t got = read (sox, buf, len);
+		if (got <= 0) {
+			return false;
+		}
+		buf += got;
+		len -= got;
+	}
+	return true;
+}
+
+/* Write exactly len bytes, or return false */
+static bool write_all (int sox, uint8_t *buf, size_t len) {
+	while (len > 0) {
+		ssize_t done = write (sox, buf, len);
+		if (done <= 0) {
+			return false;
+		}
+		buf += done;
+		len -= done;
+	}
+	return true;
+}
+
+/* Construct a minimal ClientHello record with the label as its SNI */
+static size_t make_hello (uint8_t *buf, char *label) {
+	size_t labellen = strlen (label);
+	size_t hslen = 2 + 32 + 1 + 4 + 2 + 2 + 4 + 5 + labellen;
+	size_t pos = 0;
+	buf [pos++] = 0x16; buf [pos++] = 0x03; buf [pos++] = 0x01;
+	buf [pos++] = (4 + hslen) >> 8; buf [pos++] = (4 + hslen);
+	buf [pos++] = 0x01;
+	buf [pos++] = 0; buf [pos++] = hslen >> 8; buf [pos++] = hslen;
+	buf [pos++] = 0x03; buf [pos++] = 0x03;
+	memset (buf + pos, 0, 32);
+	pos += 32;
+	buf [pos++] = 0;					// session id
+	buf [pos++] = 0; buf [pos++] = 2;			// cipher suites
+	buf [pos++] = 0x13; buf [pos++] = 0x01;
+	buf [pos++] = 1; buf [pos++] = 0;			// compression
+	buf [pos++] = (4 + 5 + labellen) >> 8; buf [pos++] = (4 + 5 + labellen);
+	buf [pos++] = 0; buf [pos++] = 0;			// server_name
+	buf [pos++] = (5 + labellen) >> 8; buf [pos++] = (5 + labellen);
+	buf [pos++] = (3 + labellen) >> 8; buf [pos++] = (3 + labellen);
+	buf [pos++] = 0;					// host_name
+	buf [pos++] = labellen >> 8; buf [pos++] = labellen;
+	memcpy (buf + pos, label, labellen);
+	return pos + labellen;
+}
+
+/* Open a TCP connection without delays for small records */
+static int open_connection (struct in6_addr *addr, uint16_t port) {
+	struct sockaddr_in6 sa;
+	int one = 1;
+	int sox = socket (AF_INET6, SOCK_STREAM, 0);
+	if (sox == -1) {
+		return -1;
+	}
+	memset (&sa, 0, sizeof (sa));
+	sa.sin6_family = AF_INET6;
+	sa.sin6_addr = *addr;
+	sa.sin6_port = htons (port);
+	if (connect (sox, (struct sockaddr *) &sa, sizeof (sa)) == -1) {
+		close (sox);
+		return -1;
+	}
+	setsockopt (sox, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+	return sox;
+}
+
+
+/* The backend, which echoes everything on each connection it accepts */
+static void *backend (void *arg) {
+	int lsox = *(int *) arg;
+	uint8_t buf [16384];
+	while (true) {
+		int one = 1;
+		ssize_t got;
+		int sox = accept (lsox, NULL, 0);
+		if (sox == -1) {
+			continue;
+		}
+		setsockopt (sox, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+		while ((got = read (sox, buf, sizeof (buf))) > 0) {
+			if (!write_all (sox, buf, got)) {
+				break;
+			}
+		}
+		close (sox);
+	}
+	return NULL;
+}
+
+/* Sort latencies */
+static int cmp_latency (const void *a, const void *b) {
+	uint64_t la = *(const uint64_t *) a, lb = *(const uint64_t *) b;
+	return (la < lb) ? -1 : (la > lb) ? 1 : 0;
+}
+
+/* Measure round trips over a connection, after sending the ClientHello.
+ * The latencies are sorted.  Returns false on failure.
+ */
+static bool measure (struct in6_addr *addr, uint16_t port, uint64_t *rtt) {
+	uint8_t hello [512];
+	uint8_t *rec = malloc (5 + latency_size);
+	uint8_t *back = malloc (5 + latency_size);
+	size_t hellolen = make_hello (hello, latency_label);
+	unsigned int ctr;
+	int sox = open_connection (addr, port);
+	if ((sox == -1) || (rec == NULL) || (back == NULL)) {
+		perror ("Failed to connect");
+		return false;
+	}
+	if (!write_all (sox, hello, hellolen) || !read_all (sox, back, hellolen)) {
+		fprintf (stderr, "No ClientHello returned from port %u\n", port);
+		return false;
+	}
+	rec [0] = 0x17; rec [1] = 0x03; rec [2] = 0x03;
+	rec [3] = latency_size >> 8; rec [4] = latency_size;
+	memset (rec + 5, 0x5a, latency_size);
+	for (ctr = 0; ctr < latency_count; ctr++) {
+		uint64_t t0 = latency_clock ();
+		if (!write_all (sox, rec, 5 + latency_size) || !read_all (sox, back, 5 + latency_size)) {
+			fprintf (stderr, "Connection to port %u ended after %u records\n", port, ctr);
+			return false;
+		}
+		rtt [ctr] = latency_clock () - t0;
+	}
+	close (sox);
+	free (rec);
+	free (back);
+	qsort (rtt, latency_count, sizeof (uint64_t), cmp_latency);
+	return true;
+}
+
+/* Return a percentile of sorted latencies, in parts per thousand */
+static uint64_t percentile (uint64_t *rtt, unsigned int permille) {
+	unsigned int idx = (unsigned int) (((uint64_t) latency_count * permille) / 1000);
+	return rtt [(idx < latency_count) ? idx : (latency_count - 1)];
+}
+
+
+/* Main program */
+int main (int argc, char *argv []) {
+	int opt;
+	int lsox;
+	int one = 1;
+	struct sockaddr_in6 sa;
+	struct in6_addr loopback = IN6ADDR_LOOPBACK_INIT;
+	pthread_t thread;
+	uint64_t *direct, *relayed;
+	static unsigned int permilles [] = { 500, 900, 990, 999 };
+	static char *names [] = { "p50", "p90", "p99", "p99.9" };
+	unsigned int ctr;
+	//
+	// Commandline.
+	//
+	while ((opt = getopt (argc, argv, "a:p:l:b:n:s:")) != -1) {
+		switch (opt) {
+		case 'a':
+			if (inet_pton (AF_INET6, optarg, &latency_addr) != 1) {
+				fprintf (stderr, "%s: Not an IPv6 address: %s\n", argv [0], optarg);
+				exit (1);
+			}
+			break;
+		case 'p':
+			latency_port = strtoul (optarg, NULL, 10);
+			break;
+		case 'l':
+			latency_label = optarg;
+			break;
+		case 'b':
+			latency_backend = strtoul (optarg, NULL, 10);
+			break;
+		case 'n':
+			latency_count = strtoul (optarg, NULL, 10);
+			break;
+		case 's':
+			latency_size = strtoul (optarg, NULL, 10);
+			break;
+		default:
+			latency_label = NULL;
+			break;
+		}
+	}
+	if ((latency_label == NULL) || (strlen (latency_label) > 255) || (latency_backend == 0) ||
+			(latency_count == 0) || (latency_size == 0) || (latency_size > 16384)) {
+		fprintf (stderr, "Usage: %s -l label -b backendport [-a address] [-p port] [-n records] [-s size]\nDefaults are: -a ::1 -p 4433 -n 10000 -s 64\n", argv [0]);
+		exit (1);
+	}
+	direct  = calloc (latency_count, sizeof (uint64_t));
+	relayed = calloc (latency_count, sizeof (uint64_t));
+	if ((direct == NULL) || (relayed == NULL)) {
+		fprintf (stderr, "Out of memory for latencies\n");
+		exit (1);
+	}
+	//
+	// Backend.
+	//
+	lsox = socket (AF_INET6, SOCK_STREAM, 0);
+	if (lsox == -1) {
+		perror ("Failed to allocate a backend socket");
+		exit (1);
+	}
+	setsockopt (lsox, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+	memset (&sa, 0, sizeof (sa));
+	sa.sin6_family = AF_INET6;
+	sa.sin6_port = htons (latency_backend);
+	if ((bind (lsox, (struct sockaddr *) &sa, sizeof (sa)) == -1) || (listen (lsox, 5) == -1)) {
+		perror ("Failed to listen on the backend port");
+		exit (1);
+	}
+	if (pthread_create (&thread, NULL, backend, &lsox) != 0) {
+		fprintf (stderr, "Failed to start the backend\n");
+		exit (1);
+	}
+	//
+	// Measurements.
+	//
+	if (!measure (&loopback, latency_backend, direct) || !measure (&latency_addr, latency_port, relayed)) {
+		exit (1);
+	}
+	printf ("Round trips of %u records of %u bytes, in microseconds\n", latency_count, latency_size);
+	printf ("%-8s %10s %10s %10s\n", "", "direct", "relayed", "added");
+	for (ctr = 0; ctr < sizeof (permilles) / sizeof (permilles [0]); ctr++) {
+		uint64_t d = percentile (direct, permilles [ctr]);
+		uint64_t r = percentile (relayed, permilles [ctr]);
+		printf ("%-8s %10.1f %10.1f %10.1f\n", names [ctr], d / 1000.0, r / 1000.0, ((double) r - (double) d) / 1000.0);
+	}
+	exit (0);
+}
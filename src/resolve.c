@@ -0,0 +1,585 @@
+/* snitch/resolve.c -- Asynchronous resolution of backend hostnames.
+ *
+ * Mappings may name their backend by hostname instead of an address.
+ * Names are looked up by a resolver thread, so the daemon loop never
+ * blocks on DNS.  The results go into a cache of hostcache entries,
+ * which the mappings point to.  The resolver thread reports completed
+ * lookups over a pipe, which the daemon loop polls; it then commits
+ * the result to the cache and retries connections that waited for it.
+ *
+ * Lookups first consult a hosts file, then send DNS queries to one
+ * nameserver.  Only DNS answers carry a TTL; hosts file entries are
+ * kept for HOSTS_TTL_SEC so that changes to the file are noticed.
+ * Names that do not exist are cached as negative, with the TTL from
+ * the SOA record in the answer as per RFC 2308.  When an entry expires,
+ * its address continues to be used while it is being looked up again,
+ * for up to STALE_SEC after expiry or until the name is found gone.
+ *
+ * The DNS messages are composed and parsed here, because the system's
+ * resolver functions do not report TTLs.  Queries have a random ID, and
+ * answers must repeat the question and hold records for the name asked
+ * for, or for the names that it is an alias of.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fun.h"
+
+
+#define NS_PER_SEC 1000000000ULL
+
+/* Timing of the cache, in seconds */
+#define MIN_TTL_SEC		1
+#define HOSTS_TTL_SEC		60
+#define NEGATIVE_TTL_SEC	30
+#define FAILURE_TTL_SEC		5
+#define STALE_SEC		3600
+
+/* DNS queries are retried this often, waiting this long for each */
+#define DNS_TRIES		3
+#define DNS_TIMEOUT_MS		2000
+
+/* Results of a lookup */
+#define RESOLVE_OK		0
+#define RESOLVE_NONAME		1
+#define RESOLVE_FAILED		2
+#define RESOLVE_NXDOMAIN	3
+
+
+/* The cache, and the queue of entries for the resolver thread */
+static struct hostcache *hostcache = NULL;
+static struct hostcache *queue_head = NULL;
+static struct hostcache *queue_tail = NULL;
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t resolve_cond = PTHREAD_COND_INITIALIZER;
+static int resolve_pipe [2] = { -1, -1 };
+
+
+
+/* Look for a name in the hosts file.  IPv4 addresses are mapped into
+ * IPv6, and IPv6 addresses are preferred.
+ */
+static int lookup_hosts (char *name, struct in6_addr *addr, uint32_t *ttl) {
+	FILE *hosts = fopen (setting_hostsfile, "r");
+	char line [1024];
+	bool found = false;
+	if (hosts == NULL) {
+		return RESOLVE_NONAME;
+	}
+	while (fgets (line, sizeof (line), hosts) != NULL) {
+		char *save;
+		char *word = strtok_r (line, " \t\r\n", &save);
+		struct in6_addr lineaddr;
+		bool v6;
+		if ((word == NULL) || (*word == '#')) {
+			continue;
+		}
+		v6 = (inet_pton (AF_INET6, word, &lineaddr) == 1);
+		if (!v6) {
+			struct in_addr v4;
+			if (inet_pton (AF_INET, word, &v4) != 1) {
+				continue;
+			}
+			memset (&lineaddr, 0, sizeof (lineaddr));
+			lineaddr.s6_addr [10] = lineaddr.s6_addr [11] = 0xff;
+			memcpy (&lineaddr.s6_addr [12], &v4, 4);
+		}
+		while ((word = strtok_r (NULL, " \t\r\n", &save)) != NULL) {
+			if (*word == '#') {
+				break;
+			}
+			if ((strcasecmp (word, name) == 0) && (!found || v6)) {
+				*addr = lineaddr;
+				found = true;
+				break;
+			}
+		}
+	}
+	fclose (hosts);
+	*ttl = HOSTS_TTL_SEC;
+	return found ? RESOLVE_OK : RESOLVE_NONAME;
+}
+
+
+/* Compose a DNS query for a name and type.  Returns its length, or 0 if
+ * the name does not fit.
+ */
+static size_t dns_query (uint8_t *buf, size_t buflen, uint16_t id, char *name, uint16_t qtype) {
+	size_t pos = 12;
+	memset (buf, 0, 12);
+	buf [0] = id >> 8; buf [1] = id;
+	buf [2] = 0x01;			// RD, recursion desired
+	buf [5] = 1;			// QDCOUNT
+	while (*name) {
+		size_t labellen = strcspn (name, ".");
+		if ((labellen == 0) || (labellen > 63) || (pos + 1 + labellen + 5 > buflen)) {
+			return 0;
+		}
+		buf [pos++] = labellen;
+		memcpy (buf + pos, name, labellen);
+		pos += labellen;
+		name += labellen;
+		if (*name == '.') {
+			name++;
+		}
+	}
+	buf [pos++] = 0;
+	buf [pos++] = qtype >> 8; buf [pos++] = qtype;
+	buf [pos++] = 0; buf [pos++] = 1;	// class IN
+	return pos;
+}
+
+/* Read a possibly compressed name from a DNS message, in dotted form
+ * without a trailing dot.  Returns the position after the name where it
+ * appears, or 0 if it is malformed or does not fit.
+ */
+static size_t dns_getname (uint8_t *msg, size_t msglen, size_t pos, char *name, size_t namesize) {
+	size_t after = 0;
+	size_t namelen = 0;
+	unsigned int jumps = 0;
+	while (pos < msglen) {
+		uint8_t len = msg [pos];
+		if ((len & 0xc0) == 0xc0) {
+			if ((pos + 2 > msglen) || (++jumps > 32)) {
+				return 0;
+			}
+			if (after == 0) {
+				after = pos + 2;
+			}
+			pos = ((len & 0x3f) << 8) | msg [pos + 1];
+			continue;
+		}
+		if (len > 63) {
+			return 0;
+		}
+		if (len == 0) {
+			name [namelen] = '\0';
+			return (after != 0) ? after : (pos + 1);
+		}
+		if ((pos + 1 + len > msglen) || (namelen + 1 + len + 1 > namesize)) {
+			return 0;
+		}
+		if (namelen > 0) {
+			name [namelen++] = '.';
+		}
+		memcpy (name + namelen, msg + pos + 1, len);
+		namelen += len;
+		pos += 1 + len;
+	}
+	return 0;
+}
+
+/* Parse a DNS response to a query for A or AAAA records.  The response
+ * must have the ID and the question of the query.  Only records for the
+ * name asked for are used, and for the names that CNAME records on the
+ * way make it an alias of.  The TTL is the lowest of the records on the
+ * way to the address.  For a negative answer, it is taken from the SOA
+ * in the authority section, or else set to NEGATIVE_TTL_SEC.  A name that
+ * does not exist at all is RESOLVE_NXDOMAIN, one without records of the
+ * type asked for is RESOLVE_NONAME.
+ */
+static int dns_parse (uint8_t *msg, size_t msglen, uint8_t *query, size_t querylen, struct in6_addr *addr, uint32_t *ttl) {
+	size_t pos;
+	unsigned int ancount, nscount, rr;
+	uint8_t rcode;
+	bool found = false;
+	uint32_t minttl = UINT32_MAX;
+	uint16_t qtype = (query [querylen - 4] << 8) | query [querylen - 3];
+	char target [256];
+	if ((msglen < querylen) || (msg [0] != query [0]) || (msg [1] != query [1]) || !(msg [2] & 0x80)) {
+		return RESOLVE_FAILED;
+	}
+	rcode = msg [3] & 0x0f;
+	if ((rcode != 0) && (rcode != 3)) {
+		return RESOLVE_FAILED;
+	}
+	//
+	// The question is repeated as sent, though possibly in another case
+	//
+	if ((msg [4] != 0) || (msg [5] != 1)) {
+		return RESOLVE_FAILED;
+	}
+	for (pos = 12; pos < querylen - 4; pos++) {
+		if (tolower (msg [pos]) != tolower (query [pos])) {
+			return RESOLVE_FAILED;
+		}
+	}
+	if (memcmp (msg + pos, query + pos, 4) != 0) {
+		return RESOLVE_FAILED;
+	}
+	pos += 4;
+	if (dns_getname (query, querylen, 12, target, sizeof (target)) == 0) {
+		return RESOLVE_FAILED;
+	}
+	ancount = (msg [6] << 8) | msg [7];
+	nscount = (msg [8] << 8) | msg [9];
+	for (rr = 0; rr < ancount + nscount; rr++) {
+		uint16_t rrtype, rdlen;
+		uint32_t rrttl;
+		char owner [256];
+		pos = dns_getname (msg, msglen, pos, owner, sizeof (owner));
+		if ((pos == 0) || (pos + 10 > msglen)) {
+			return RESOLVE_FAILED;
+		}
+		rrtype = (msg [pos] << 8) | msg [pos + 1];
+		rrttl = (((uint32_t) msg [pos + 4]) << 24) | (msg [pos + 5] << 16) | (msg [pos + 6] << 8) | msg [pos + 7];
+		rdlen = (msg [pos + 8] << 8) | msg [pos + 9];
+		pos += 10;
+		if (pos + rdlen > msglen) {
+			return RESOLVE_FAILED;
+		}
+		if (rr < ancount) {
+			if (found || (strcasecmp (owner, target) != 0)) {
+				// Not on the way to the address
+			} else if (rrtype == 5) {
+				// CNAME, after which its target is looked for
+				if (dns_getname (msg, pos + rdlen, pos, target, sizeof (target)) == 0) {
+					return RESOLVE_FAILED;
+				}
+				minttl = (rrttl < minttl) ? rrttl : minttl;
+			} else if ((rrtype == 28) && (qtype == 28) && (rdlen == 16)) {
+				memcpy (addr, msg + pos, 16);
+				minttl = (rrttl < minttl) ? rrttl : minttl;
+				found = true;
+			} else if ((rrtype == 1) && (qtype == 1) && (rdlen == 4)) {
+				memset (addr, 0, sizeof (*addr));
+				addr->s6_addr [10] = addr->s6_addr [11] = 0xff;
+				memcpy (&addr->s6_addr [12], msg + pos, 4);
+				minttl = (rrttl < minttl) ? rrttl : minttl;
+				found = true;
+			}
+		} else if ((rrtype == 6) && (rdlen >= 4) && !found) {
+			// SOA, whose last field is the minimum for negative TTL
+			uint32_t soamin = (((uint32_t) msg [pos + rdlen - 4]) << 24) | (msg [pos + rdlen - 3] << 16) | (msg [pos + rdlen - 2] << 8) | msg [pos + rdlen - 1];
+			minttl = (rrttl < soamin) ? rrttl : soamin;
+		}
+		pos += rdlen;
+	}
+	if (found) {
+		*ttl = minttl;
+		return RESOLVE_OK;
+	}
+	*ttl = (minttl != UINT32_MAX) ? minttl : NEGATIVE_TTL_SEC;
+	return (rcode == 3) ? RESOLVE_NXDOMAIN : RESOLVE_NONAME;
+}
+
+/* Parse the nameserver setting, or else the first nameserver line in
+ * /etc/resolv.conf.  An address may be followed by #port.
+ */
+static bool dns_server (struct sockaddr_storage *ss, socklen_t *sslen) {
+	char buf [256];
+	char *server = setting_nameserver;
+	char *port;
+	uint16_t portnr = 53;
+	if (server == NULL) {
+		FILE *rc = fopen ("/etc/resolv.conf", "r");
+		char line [256];
+		if (rc == NULL) {
+			return false;
+		}
+		while (fgets (line, sizeof (line), rc) != NULL) {
+			if ((strncmp (line, "nameserver", 10) == 0) && isspace (line [10])) {
+				if (sscanf (line + 10, " %255s", buf) == 1) {
+					server = buf;
+					break;
+				}
+			}
+		}
+		fclose (rc);
+		if (server == NULL) {
+			return false;
+		}
+	} else {
+		snprintf (buf, sizeof (buf), "%s", server);
+		server = buf;
+	}
+	port = strchr (server, '#');
+	if (port != NULL) {
+		*port++ = '\0';
+		portnr = atoi (port);
+	}
+	memset (ss, 0, sizeof (*ss));
+	if (inet_pton (AF_INET6, server, &((struct sockaddr_in6 *) ss)->sin6_addr) == 1) {
+		((struct sockaddr_in6 *) ss)->sin6_family = AF_INET6;
+		((struct sockaddr_in6 *) ss)->sin6_port = htons (portnr);
+		*sslen = sizeof (struct sockaddr_in6);
+	} else if (inet_pton (AF_INET, server, &((struct sockaddr_in *) ss)->sin_addr) == 1) {
+		((struct sockaddr_in *) ss)->sin_family = AF_INET;
+		((struct sockaddr_in *) ss)->sin_port = htons (portnr);
+		*sslen = sizeof (struct sockaddr_in);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/* Ask the nameserver for one type of address record */
+static int lookup_dns_type (char *name, uint16_t qtype, struct in6_addr *addr, uint32_t *ttl) {
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	uint8_t query [512], answer [4096];
+	size_t querylen;
+	uint16_t id;
+	int sox, try;
+	int result = RESOLVE_FAILED;
+	if (!dns_server (&ss, &sslen)) {
+		return RESOLVE_FAILED;
+	}
+	if (getrandom (&id, sizeof (id), 0) != sizeof (id)) {
+		return RESOLVE_FAILED;
+	}
+	querylen = dns_query (query, sizeof (query), id, name, qtype);
+	if (querylen == 0) {
+		return RESOLVE_NONAME;
+	}
+	sox = socket (ss.ss_family, SOCK_DGRAM, 0);
+	if (sox == -1) {
+		return RESOLVE_FAILED;
+	}
+	if (connect (sox, (struct sockaddr *) &ss, sslen) == -1) {
+		close (sox);
+		return RESOLVE_FAILED;
+	}
+	for (try = 0; try < DNS_TRIES; try++) {
+		struct pollfd pfd = { sox, POLLIN, 0 };
+		ssize_t answerlen;
+		if (send (sox, query, querylen, 0) == -1) {
+			break;
+		}
+		if (poll (&pfd, 1, DNS_TIMEOUT_MS) != 1) {
+			continue;
+		}
+		answerlen = recv (sox, answer, sizeof (answer), 0);
+		if (answerlen <= 0) {
+			continue;
+		}
+		result = dns_parse (answer, answerlen, query, querylen, addr, ttl);
+		if (result != RESOLVE_FAILED) {
+			break;
+		}
+	}
+	close (sox);
+	return result;
+}
+
+/* Lookup a name in DNS, preferring AAAA over A records.  The A records
+ * are asked for when there are no AAAA records, and also when the AAAA
+ * query failed, as some servers fail on it.  A name that does not exist
+ * needs no second query.
+ */
+static int lookup_dns (char *name, struct in6_addr *addr, uint32_t *ttl) {
+	int result6 = lookup_dns_type (name, 28, addr, ttl);
+	uint32_t ttl6 = *ttl;
+	int result;
+	if ((result6 == RESOLVE_OK) || (result6 == RESOLVE_NXDOMAIN)) {
+		return (result6 == RESOLVE_OK) ? RESOLVE_OK : RESOLVE_NONAME;
+	}
+	result = lookup_dns_type (name, 1, addr, ttl);
+	if (result == RESOLVE_NXDOMAIN) {
+		result = RESOLVE_NONAME;
+	}
+	if (result != RESOLVE_NONAME) {
+		return result;
+	}
+	//
+	// Without A records, a failed AAAA query may still have had some
+	//
+	if (result6 == RESOLVE_FAILED) {
+		return RESOLVE_FAILED;
+	}
+	if (ttl6 < *ttl) {
+		*ttl = ttl6;
+	}
+	return RESOLVE_NONAME;
+}
+
+
+/* The resolver thread, which serves the queue of pending lookups */
+static void *resolver_thread (void *arg) {
+	while (true) {
+		struct hostcache *hc;
+		struct in6_addr addr;
+		uint32_t ttl = 0;
+		int result;
+		pthread_mutex_lock (&resolve_lock);
+		while (queue_head == NULL) {
+			pthread_cond_wait (&resolve_cond, &resolve_lock);
+		}
+		hc = queue_head;
+		queue_head = hc->qnext;
+		if (queue_head == NULL) {
+			queue_tail = NULL;
+		}
+		pthread_mutex_unlock (&resolve_lock);
+		result = lookup_hosts (hc->name, &addr, &ttl);
+		if (result != RESOLVE_OK) {
+			result = lookup_dns (hc->name, &addr, &ttl);
+		}
+		pthread_mutex_lock (&resolve_lock);
+		hc->res_result = result;
+		hc->res_addr = addr;
+		hc->res_ttl = ttl;
+		pthread_mutex_unlock (&resolve_lock);
+		if (write (resolve_pipe [1], &hc, sizeof (hc)) != sizeof (hc)) {
+			perror ("Resolver failed to report");
+		}
+	}
+	return NULL;
+}
+
+/* Start the resolver thread, if it is not running yet */
+static int resolver_start (void) {
+	pthread_t thread;
+	if (resolve_pipe [0] != -1) {
+		return 0;
+	}
+	if (pipe (resolve_pipe) == -1) {
+		return -1;
+	}
+	fcntl (resolve_pipe [0], F_SETFL, O_NONBLOCK);
+	if (pthread_create (&thread, NULL, resolver_thread, NULL) != 0) {
+		close (resolve_pipe [0]);
+		close (resolve_pipe [1]);
+		resolve_pipe [0] = resolve_pipe [1] = -1;
+		return -1;
+	}
+	pthread_detach (thread);
+	return 0;
+}
+
+
+/* Return the file descriptor on which lookups complete, or -1 if
+ * there is no resolver.
+ */
+int resolve_fd (void) {
+	return resolve_pipe [0];
+}
+
+/* Find or add the cache entry for a hostname.  This starts the resolver
+ * and asks it to lookup the name, so it is known when traffic arrives.
+ * Returns NULL on failure.
+ */
+struct hostcache *hostcache_get (char *name) {
+	struct hostcache *hc;
+	for (hc = hostcache; hc != NULL; hc = hc->next) {
+		if (strcasecmp (hc->name, name) == 0) {
+			return hc;
+		}
+	}
+	if (resolver_start () == -1) {
+		return NULL;
+	}
+	hc = calloc (1, sizeof (struct hostcache));
+	if (hc == NULL) {
+		return NULL;
+	}
+	hc->name = name;
+	hc->next = hostcache;
+	hostcache = hc;
+	resolve_request (hc);
+	return hc;
+}
+
+/* Ask the resolver thread to lookup a cache entry, unless it already is */
+void resolve_request (struct hostcache *hc) {
+	if (hc->pending) {
+		return;
+	}
+	hc->pending = true;
+	hc->qnext = NULL;
+	pthread_mutex_lock (&resolve_lock);
+	if (queue_tail != NULL) {
+		queue_tail->qnext = hc;
+	} else {
+		queue_head = hc;
+	}
+	queue_tail = hc;
+	pthread_cond_signal (&resolve_cond);
+	pthread_mutex_unlock (&resolve_lock);
+}
+
+/* Commit a completed lookup to its cache entry.  A failed lookup leaves
+ * a known address in use until it is too stale, and is retried soon.
+ */
+static void resolve_commit (struct hostcache *hc) {
+	int result;
+	uint32_t ttl;
+	pthread_mutex_lock (&resolve_lock);
+	result = hc->res_result;
+	ttl = hc->res_ttl;
+	if (result == RESOLVE_OK) {
+		hc->addr = hc->res_addr;
+	}
+	pthread_mutex_unlock (&resolve_lock);
+	hc->pending = false;
+	switch (result) {
+	case RESOLVE_OK:
+		if (ttl < MIN_TTL_SEC) {
+			ttl = MIN_TTL_SEC;
+		}
+		hc->valid = true;
+		hc->expires = now + ttl * NS_PER_SEC;
+		hc->stale_until = hc->expires + STALE_SEC * NS_PER_SEC;
+		fprintf (stderr, "Resolved %s for %u seconds\n", hc->name, ttl);
+		break;
+	case RESOLVE_NONAME:
+		if (ttl < MIN_TTL_SEC) {
+			ttl = MIN_TTL_SEC;
+		}
+		hc->valid = false;
+		hc->expires = now + ttl * NS_PER_SEC;
+		fprintf (stderr, "Resolved %s as nonexistent for %u seconds\n", hc->name, ttl);
+		break;
+	default:
+		hc->expires = now + FAILURE_TTL_SEC * NS_PER_SEC;
+		fprintf (stderr, "Failed to resolve %s, retrying in %u seconds\n", hc->name, FAILURE_TTL_SEC);
+		break;
+	}
+}
+
+/* Process lookups that the resolver thread completed.  Each is returned
+ * to the caller's callback, which retries connections that waited for it.
+ */
+void resolve_complete (void (*retry) (struct hostcache *hc)) {
+	struct hostcache *hc;
+	while (read (resolve_pipe [0], &hc, sizeof (hc)) == sizeof (hc)) {
+		resolve_commit (hc);
+		retry (hc);
+	}
+}
+
+/* Return the address to use for a cache entry, or NULL if there is none.
+ * An expired entry is looked up again, but a stale address continues to
+ * be used meanwhile.  When NULL is returned, errno is EINPROGRESS while a
+ * lookup is pending, or EHOSTUNREACH if the name is known not to resolve.
+ */
+struct in6_addr *hostcache_addr (struct hostcache *hc) {
+	if (hc->expires <= now) {
+		resolve_request (hc);
+	}
+	if (hc->valid && (now < hc->stale_until)) {
+		return &hc->addr;
+	}
+	errno = hc->pending ? EINPROGRESS : EHOSTUNREACH;
+	return NULL;
+}
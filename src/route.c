@@ -0,0 +1,303 @@
+/* snitch/route.c -- Routing on the label and the client address.
+ *
+ * A label may have several mappings, each for clients from different
+ * address prefixes, as set with their from= flags.  The mapping with
+ * the longest prefix that matches the client address is used, and a
+ * mapping without from= flags matches any client.  Client addresses are
+ * IPv6, with IPv4 clients as IPv4-mapped addresses.
+ *
+ * The prefixes of a label are compiled into a routetable with two tries,
+ * one for IPv4-mapped addresses and one for other IPv6 addresses.  The
+ * tries branch on a byte of the address in each node, and the prefixes
+ * are expanded to whole bytes, so every entry holds either a child node
+ * or the result for all addresses below it.  A lookup takes one memory
+ * access per byte, until it finds a result; for IPv4 that is at most 4.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+
+#include <poll.h>
+
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fun.h"
+
+
+/* Each trie node branches on one byte.  An entry with ROUTE_CHILD set
+ * holds the index of a child node, otherwise it holds 1 + the index of
+ * a target mapping, or 0 when no prefix matches.
+ */
+#define ROUTE_FANOUT	256
+#define ROUTE_CHILD	0x80000000
+
+typedef uint32_t routenode [ROUTE_FANOUT];
+
+struct routetrie {
+	routenode *nodes;
+	uint32_t nodes_used, nodes_allocated;
+};
+
+struct routetable {
+	struct routetrie v4, v6;
+	struct mapping **targets;
+	unsigned int targets_used;
+};
+
+/* A prefix of a mapping, while compiling the routetable of its label */
+struct routeprefix {
+	const struct addrprefix *pfx;
+	unsigned int target;
+	unsigned int order;
+};
+
+static const struct addrprefix route_anywhere = { IN6ADDR_ANY_INIT, 0 };
+static const uint8_t route_v4mapped [12] = { 0,0,0,0,0,0,0,0,0,0,0xff,0xff };
+
+
+/* Parse a prefix of the form address/length, where the address is either
+ * IPv6 or IPv4.  IPv4 prefixes are mapped into IPv6.  Without a length,
+ * the prefix holds only the address.  Returns true on success.
+ */
+bool route_parse_prefix (char *str, size_t len, struct addrprefix *pfx) {
+	char buf [INET6_ADDRSTRLEN + 5];
+	char *slash, *end;
+	unsigned long pfxlen;
+	bool v4;
+	struct in_addr v4addr;
+	if (len >= sizeof (buf)) {
+		return false;
+	}
+	memcpy (buf, str, len);
+	buf [len] = '\0';
+	slash = strchr (buf, '/');
+	if (slash != NULL) {
+		*slash++ = '\0';
+	}
+	v4 = (inet_pton (AF_INET, buf, &v4addr) == 1);
+	if (v4) {
+		memcpy (pfx->addr.s6_addr, route_v4mapped, 12);
+		memcpy (pfx->addr.s6_addr + 12, &v4addr, 4);
+	} else if (inet_pton (AF_INET6, buf, &pfx->addr) != 1) {
+		return false;
+	}
+	if (slash == NULL) {
+		pfx->len = 128;
+		return true;
+	}
+	pfxlen = strtoul (slash, &end, 10);
+	if ((*slash == '\0') || (*end != '\0') || (pfxlen > (v4 ? 32 : 128))) {
+		return false;
+	}
+	pfx->len = v4 ? (96 + pfxlen) : pfxlen;
+	return true;
+}
+
+
+/* Allocate a trie node, filled with an entry.  Returns its index, or
+ * ROUTE_CHILD on failure.
+ */
+static uint32_t route_newnode (struct routetrie *trie, uint32_t fill) {
+	int ctr;
+	if (trie->nodes_used == trie->nodes_allocated) {
+		routenode *newnodes = realloc (trie->nodes, (trie->nodes_allocated + 16) * sizeof (routenode));
+		if (newnodes == NULL) {
+			return ROUTE_CHILD;
+		}
+		trie->nodes = newnodes;
+		trie->nodes_allocated += 16;
+	}
+	for (ctr = 0; ctr < ROUTE_FANOUT; ctr++) {
+		trie->nodes [trie->nodes_used] [ctr] = fill;
+	}
+	return trie->nodes_used++;
+}
+
+/* Insert a prefix of the key bytes with a target entry.  Prefixes must
+ * be inserted from short to long, so that longer ones override shorter
+ * ones; entries are copied into new child nodes as they are created.
+ * Returns 0 on success, or -1 on failure.
+ */
+static int route_insert (struct routetrie *trie, const uint8_t *key, unsigned int pfxlen, uint32_t entry) {
+	uint32_t node = 0;
+	unsigned int depth = 0;
+	unsigned int rest, first, ctr;
+	while (pfxlen > 8 * depth + 8) {
+		uint32_t *e = &trie->nodes [node] [key [depth]];
+		if (!(*e & ROUTE_CHILD)) {
+			uint32_t child = route_newnode (trie, *e);
+			if (child == ROUTE_CHILD) {
+				return -1;
+			}
+			// The realloc() may have moved the entry
+			trie->nodes [node] [key [depth]] = ROUTE_CHILD | child;
+		}
+		node = trie->nodes [node] [key [depth]] & ~ROUTE_CHILD;
+		depth++;
+	}
+	rest = pfxlen - 8 * depth;
+	first = (rest == 0) ? 0 : (key [depth] & (0xff00 >> rest));
+	for (ctr = first; ctr < first + (1 << (8 - rest)); ctr++) {
+		trie->nodes [node] [ctr] = entry;
+	}
+	return 0;
+}
+
+/* Lookup the entry for the key bytes in a trie */
+static uint32_t route_find (struct routetrie *trie, const uint8_t *key) {
+	uint32_t entry = trie->nodes [0] [key [0]];
+	while (entry & ROUTE_CHILD) {
+		key++;
+		entry = trie->nodes [entry & ~ROUTE_CHILD] [key [0]];
+	}
+	return entry;
+}
+
+
+/* Tell whether a prefix matches IPv4-mapped addresses; it may cover all
+ * of ::ffff:0:0/96, or be inside it.
+ */
+static bool route_matches_v4 (const struct addrprefix *pfx) {
+	unsigned int bit;
+	for (bit = 0; (bit < pfx->len) && (bit < 96); bit++) {
+		if ((pfx->addr.s6_addr [bit / 8] ^ route_v4mapped [bit / 8]) & (0x80 >> (bit % 8))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Order prefixes from short to long, and otherwise as configured */
+static int route_cmpprefix (const void *a, const void *b) {
+	const struct routeprefix *pa = a, *pb = b;
+	if (pa->pfx->len != pb->pfx->len) {
+		return (pa->pfx->len < pb->pfx->len) ? -1 : 1;
+	}
+	return (pa->order > pb->order) ? -1 : 1;
+}
+
+/* Compile the prefixes of the mappings for one label into a routetable.
+ * A prefix that covers all of ::ffff:0:0/96 matches all IPv4 clients, so
+ * it is inserted into both tries.  Returns NULL on failure.
+ */
+static struct routetable *route_compile (struct mapping *first) {
+	struct routetable *rt;
+	struct routeprefix *pfxs = NULL;
+	unsigned int pfxs_used = 0;
+	unsigned int ctr;
+	struct mapping *map;
+	rt = calloc (1, sizeof (struct routetable));
+	if (rt == NULL) {
+		return NULL;
+	}
+	if ((route_newnode (&rt->v4, 0) == ROUTE_CHILD) || (route_newnode (&rt->v6, 0) == ROUTE_CHILD)) {
+		goto fail;
+	}
+	for (map = first; map != NULL; map = map->next) {
+		unsigned int count = (map->from_count > 0) ? map->from_count : 1;
+		struct mapping **newtargets;
+		struct routeprefix *newpfxs;
+		if (strcmp (map->label, first->label) != 0) {
+			continue;
+		}
+		newtargets = realloc (rt->targets, (rt->targets_used + 1) * sizeof (struct mapping *));
+		if (newtargets == NULL) {
+			goto fail;
+		}
+		rt->targets = newtargets;
+		newpfxs = realloc (pfxs, (pfxs_used + count) * sizeof (struct routeprefix));
+		if (newpfxs == NULL) {
+			goto fail;
+		}
+		pfxs = newpfxs;
+		for (ctr = 0; ctr < count; ctr++) {
+			pfxs [pfxs_used].pfx = (map->from_count > 0) ? &map->from [ctr] : &route_anywhere;
+			pfxs [pfxs_used].target = rt->targets_used;
+			pfxs [pfxs_used].order = pfxs_used;
+			pfxs_used++;
+		}
+		rt->targets [rt->targets_used++] = map;
+	}
+	//
+	// Equal prefixes are inserted in reverse order, so the first listed
+	// mapping wins
+	//
+	qsort (pfxs, pfxs_used, sizeof (struct routeprefix), route_cmpprefix);
+	for (ctr = 0; ctr < pfxs_used; ctr++) {
+		const struct addrprefix *pfx = pfxs [ctr].pfx;
+		uint32_t entry = 1 + pfxs [ctr].target;
+		bool inv4 = route_matches_v4 (pfx);
+		if (inv4) {
+			if (route_insert (&rt->v4, pfx->addr.s6_addr + 12, (pfx->len > 96) ? (pfx->len - 96) : 0, entry) == -1) {
+				goto fail;
+			}
+		}
+		if ((pfx->len <= 96) || !inv4) {
+			if (route_insert (&rt->v6, pfx->addr.s6_addr, pfx->len, entry) == -1) {
+				goto fail;
+			}
+		}
+	}
+	free (pfxs);
+	fprintf (stderr, "Routing %s on client address with %u + %u trie nodes\n", first->label, rt->v4.nodes_used, rt->v6.nodes_used);
+	return rt;
+fail:
+	free (pfxs);
+	free (rt->targets);
+	free (rt->v4.nodes);
+	free (rt->v6.nodes);
+	free (rt);
+	return NULL;
+}
+
+/* Setup routing for the labels that have mappings with from= flags.
+ * The routetable is shared by all mappings of a label, but lookups
+ * start at the first, as that is the one found for the label.
+ * Returns 0 on success, or -1 on failure.
+ */
+int setup_routes (struct mapping *maps) {
+	struct mapping *map, *other;
+	for (map = maps; map != NULL; map = map->next) {
+		bool routed = false;
+		if (map->routes != NULL) {
+			continue;
+		}
+		for (other = map; other != NULL; other = other->next) {
+			if ((strcmp (other->label, map->label) == 0) && (other->from_count > 0)) {
+				routed = true;
+			}
+		}
+		if (!routed) {
+			continue;
+		}
+		map->routes = route_compile (map);
+		if (map->routes == NULL) {
+			fprintf (stderr, "Failed to setup routing for %s\n", map->label);
+			return -1;
+		}
+		for (other = map->next; other != NULL; other = other->next) {
+			if (strcmp (other->label, map->label) == 0) {
+				other->routes = map->routes;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Return the mapping to use for a client address, or NULL if none */
+struct mapping *route_lookup (struct routetable *rt, struct in6_addr *client) {
+	uint32_t entry;
+	if (memcmp (client->s6_addr, route_v4mapped, 12) == 0) {
+		entry = route_find (&rt->v4, client->s6_addr + 12);
+	} else {
+		entry = route_find (&rt->v6, client->s6_addr);
+	}
+	return (entry != 0) ? rt->targets [entry - 1] : NULL;
+}
@@ -0,0 +1,143 @@
+/* snitch/shape.c -- Bandwidth shaping with token buckets.
+ *
+ * Every mapping holds a token bucket that is shared by all connections
+ * through it, and every proxy side holds a token bucket of its own.
+ * Reading from a proxy side consumes tokens from both.  When either is
+ * empty, the proxy side is parked; it stops polling for input until
+ * the bucket has refilled enough for another quantum.
+ *
+ * Refilling is computed from the time passed since the last refill, so
+ * all accounting is constant-time and there are no timers to maintain.
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <poll.h>
+
+#include <netinet/in.h>
+
+#include "fun.h"
+
+
+#define NS_PER_SEC 1000000000ULL
+
+
+/* Return the current time in nanoseconds on a monotonic clock. */
+uint64_t shape_clock (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec) * NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+
+/* Setup a token bucket with a rate in bytes per second and a burst
+ * size in bytes.  A rate of 0 means unlimited.  The bucket starts full.
+ */
+void tokenbucket_init (struct tokenbucket *tb, uint32_t rate, uint32_t burst, uint64_t now) {
+	if (burst == 0) {
+		burst = MAXRECLEN;
+	}
+	tb->rate = rate;
+	tb->burst = burst;
+	tb->fillns = (rate > 0) ? (((uint64_t) burst) * NS_PER_SEC / rate) : 0;
+	tb->tokens = burst;
+	tb->stamp = now;
+}
+
+/* Refill a token bucket with the tokens accumulated since its stamp.
+ * The stamp only advances by the time that was actually converted into
+ * tokens, so rounding does not make the bucket lose capacity.
+ */
+static void tokenbucket_refill (struct tokenbucket *tb, uint64_t now) {
+	uint64_t elapsed, added;
+	if (now <= tb->stamp) {
+		return;
+	}
+	elapsed = now - tb->stamp;
+	if (elapsed >= tb->fillns) {
+		tb->tokens = tb->burst;
+		tb->stamp = now;
+		return;
+	}
+	// elapsed < fillns, so elapsed * rate < burst * NS_PER_SEC
+	added = elapsed * tb->rate / NS_PER_SEC;
+	if (added == 0) {
+		return;
+	}
+	tb->tokens += added;
+	tb->stamp += added * NS_PER_SEC / tb->rate;
+	if (tb->tokens >= tb->burst) {
+		tb->tokens = tb->burst;
+		tb->stamp = now;
+	}
+}
+
+/* Return how many of the wanted bytes the bucket currently permits. */
+size_t tokenbucket_allow (struct tokenbucket *tb, uint64_t now, size_t want) {
+	if (tb->rate == 0) {
+		return want;
+	}
+	tokenbucket_refill (tb, now);
+	return (want < tb->tokens) ? want : (size_t) tb->tokens;
+}
+
+/* Consume tokens for bytes that passed through. */
+void tokenbucket_take (struct tokenbucket *tb, size_t used) {
+	if (tb->rate == 0) {
+		return;
+	}
+	tb->tokens = (used < tb->tokens) ? (tb->tokens - used) : 0;
+}
+
+/* Return the time at which the bucket holds at least one quantum,
+ * or at least its full burst size if that is smaller.
+ */
+uint64_t tokenbucket_wakeup (struct tokenbucket *tb) {
+	uint64_t want = (tb->burst < SHAPE_QUANTUM) ? tb->burst : SHAPE_QUANTUM;
+	if ((tb->rate == 0) || (tb->tokens >= want)) {
+		return tb->stamp;
+	}
+	return tb->stamp + ((want - tb->tokens) * NS_PER_SEC + tb->rate - 1) / tb->rate;
+}
+
+
+/* Setup the per-connection bucket for a proxy side from its mapping. */
+void shape_init_proxy (struct proxy *pxy, uint64_t now) {
+	struct mapping *map = pxy->proxymap;
+	tokenbucket_init (&pxy->cnxbucket, map->cnxrate, map->cnxburst, now);
+}
+
+/* Return the number of bytes a proxy side may read now, at most want.
+ * This combines the per-connection and the per-mapping token buckets.
+ * Proxies without a mapping, so before the first record was processed,
+ * are not shaped.
+ */
+size_t shape_allowance (struct proxy *pxy, uint64_t now, size_t want) {
+	if (pxy->proxymap == NULL) {
+		return want;
+	}
+	want = tokenbucket_allow (&pxy->cnxbucket, now, want);
+	want = tokenbucket_allow (&pxy->proxymap->mapbucket, now, want);
+	return want;
+}
+
+/* Charge the bytes read by a proxy side to its token buckets. */
+void shape_charge (struct proxy *pxy, size_t used) {
+	if (pxy->proxymap == NULL) {
+		return;
+	}
+	tokenbucket_take (&pxy->cnxbucket, used);
+	tokenbucket_take (&pxy->proxymap->mapbucket, used);
+}
+
+/* Return the time at which a parked proxy side may read again. */
+uint64_t shape_wakeup (struct proxy *pxy) {
+	uint64_t cnxwake = tokenbucket_wakeup (&pxy->cnxbucket);
+	uint64_t mapwake = tokenbucket_wakeup (&pxy->proxymap->mapbucket);
+	return (cnxwake > mapwake) ? cnxwake : mapwake;
+}
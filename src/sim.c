@@ -0,0 +1,1456 @@
+/* snitch/sim.c -- Deterministic simulation of the SNItch daemon.
+ *
+ * This program runs the daemon loop over a simulated I/O backend instead
+ * of real sockets.  It plays both the clients and the backend servers of
+ * a number of connections, and checks that every byte that a client sends
+ * arrives at the backend for its label and client address, and vice
+ * versa.  A pseudo-random generator with a fixed seed injects faults, so
+ * a run is reproducible from its commandline:
+ *
+ *  - partial reads and writes, which return fewer bytes than asked;
+ *  - EAGAIN on reads and writes, as for a full or empty socket buffer;
+ *  - connection resets, reported as POLLERR and ECONNRESET;
+ *  - reordering, by holding back readiness of some sockets in a poll();
+ *  - EMFILE from accept() and ECONNREFUSED from connect().
+ *
+ * After EMFILE, accept() keeps failing until a file descriptor is closed.
+ * When that is the spare of the daemon, the connection it accepts next
+ * is expected to be closed right away.  The global connection cap is set
+ * below the number of parallel connections, and one mapping has its own
+ * cap, so the daemon pauses its listener and refuses connections; the
+ * simulator checks that it does not accept or connect beyond the caps.
+ *
+ * TCP does not reorder bytes within a connection, so reordering applies
+ * to the interleaving of events between connections.
+ *
+ * The first record of each connection is a ClientHello, either generated
+ * or replayed from a trace file of concatenated TLS records.  Time is
+ * simulated too, so that bandwidth shaping is deterministic as well.
+ *
+ * Some mappings forward to a hostname.  The resolver thread looks up one
+ * in a hosts file written by the simulator, and the others with a stub
+ * nameserver on a loopback port.  The stub answers with aliases, records
+ * for other names, a failing or empty AAAA lookup, a name that does not
+ * exist, and an answer to another question.  The thread runs in real
+ * time, so its lookups are only reported when connections wait for them,
+ * or when nothing else can happen.  This makes the daemon hold the first
+ * connections for the mappings, and retry them after the lookups.  The
+ * simulator checks the address and the TTL that each lookup found.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fun.h"
+
+
+/* Settings, as used by the daemon */
+unsigned int setting_maxcnx = 0;
+unsigned int setting_tracesample = 0;
+char *setting_hostsfile = "/etc/hosts";
+char *setting_nameserver = NULL;
+
+
+/* Simulated file descriptors start here, to stand out in traces */
+#define SIM_FDBASE 1000
+
+/* Maximum number of records replayed from a trace file */
+#define SIM_MAXTRACES 1024
+
+/* The hostname in the hosts file, and its address */
+#define SIM_HOSTNAME	"backend.sim"
+#define SIM_HOSTADDR	"2001:db8::53"
+
+/* DNS record types */
+#define SIM_DNS_A	1
+#define SIM_DNS_CNAME	5
+#define SIM_DNS_SOA	6
+#define SIM_DNS_AAAA	28
+
+/* Reasons for a connection to end */
+#define SIM_OK		0
+#define SIM_REFUSED	1
+#define SIM_RESET	2
+
+
+/* A simulated connection, with a client that connects to the daemon
+ * and a server that the daemon connects to.  The up stream runs from
+ * client to server and starts with the ClientHello, the down stream
+ * runs from server to client.  For each stream, the simulator tracks
+ * how much arrived at the daemon, how much it read and how much it
+ * wrote to the other side.
+ */
+struct simcnx {
+	unsigned int id;
+	int expect;
+	bool reset, hangup, finished;
+	int clientfd, serverfd;
+	bool connected;
+	bool capped, counted;
+	bool lowclient, lowserver;
+	uint16_t port;
+	struct in6_addr peer;
+	uint8_t *upbuf, *dnbuf;
+	size_t uplen, dnlen, hellolen;
+	size_t upavail, dnavail;
+	size_t upread, dnread;
+	size_t upwritten, dnwritten;
+};
+
+/* A simulated socket, which is either the listener, a client socket
+ * as accepted by the daemon, a server socket as connected by it, or the
+ * spare file descriptor that the daemon reserves.
+ */
+#define SIM_FREE	0
+#define SIM_LISTENER	1
+#define SIM_CLIENT	2
+#define SIM_SERVER	3
+#define SIM_SPARE	4
+
+struct simsock {
+	int kind;
+	struct simcnx *cnx;
+};
+
+/* A hostname that a mapping forwards to, with the address and the TTL
+ * that the resolver should find, or no address if it does not resolve.
+ * The cache entry is checked after each lookup of the name.
+ */
+struct simname {
+	char *name;
+	char *addr;
+	uint32_t ttl;
+	struct hostcache *hc;
+	bool looked_up;
+};
+
+/* A ClientHello to send, with the label that selects its mappings */
+struct simhello {
+	uint8_t *rec;
+	size_t reclen;
+	char *label;
+};
+
+
+/* Simulation settings */
+uint64_t sim_seed = 1;
+unsigned int sim_connections = 10000;
+unsigned int sim_parallel = 64;
+unsigned int sim_records = 4;
+unsigned int sim_faultrate = 50;
+char *sim_tracefile = NULL;
+bool sim_verbose = false;
+bool sim_tracedump = false;
+
+/* Simulation state */
+uint64_t sim_rnd;
+uint64_t sim_now = 1000000000ULL;
+uint64_t sim_events = 0;
+struct simsock *simsocks = NULL;
+unsigned int simsocks_allocated = 0;
+int *sim_freefds = NULL;
+unsigned int sim_freefds_used = 0;
+struct simcnx *sim_cnx = NULL;
+struct simcnx *sim_lastread = NULL;
+unsigned int sim_started = 0;
+unsigned int sim_accepted = 0;
+unsigned int sim_finished = 0;
+unsigned int sim_unfinished = 0;
+unsigned int sim_outcome [3] = { 0, 0, 0 };
+unsigned int sim_failures = 0;
+struct simhello sim_hellos [SIM_MAXTRACES];
+unsigned int sim_hellos_used = 0;
+struct simcnx **sim_retries = NULL;
+unsigned int sim_retries_allocated = 0;
+unsigned int sim_retries_used = 0;
+unsigned int sim_retries_next = 0;
+unsigned int sim_held = 0;
+unsigned int sim_clients = 0;
+bool sim_atcap = false;
+bool sim_emfile = false;
+bool sim_refusing = false;
+unsigned int sim_spares = 0;
+uint64_t sim_resolved_at = 0;
+char sim_hostsfile [] = "/tmp/snitch-sim-hosts-XXXXXX";
+char sim_nameserver [32];
+int sim_stub_sox = -1;
+FILE *simout;
+
+
+/* Mappings for the generated ClientHello records; replayed traces add
+ * more.  The shaping flags on www.sim make the daemon park connections,
+ * and its cap makes it refuse some.  Clients of ssh.sim are routed on
+ * their address, and kdc.sim refuses clients from outside its prefixes.
+ * Internal ssh.sim clients are in low-latency mode, so the daemon spins
+ * while they are active.  The backends of dns.sim and the mappings after
+ * it are hostnames, which are listed in sim_names.  The one of gone.sim
+ * does not resolve, so the daemon refuses its clients.
+ */
+struct mapping sim_map_kdc = { NULL,         "kdc.sim", IN6ADDR_LOOPBACK_INIT,  88, "from=2001:db8::/32 from=10.0.0.0/8" };
+struct mapping sim_map_lan = { &sim_map_kdc, "ssh.sim", IN6ADDR_LOOPBACK_INIT, 2222, "from=2001:db8:1::/48 from=10.0.0.0/8 busypoll=50" };
+struct mapping sim_map_ssh = { &sim_map_lan, "ssh.sim", IN6ADDR_LOOPBACK_INIT,  22, "" };
+struct mapping sim_map_www = { &sim_map_ssh, "www.sim", IN6ADDR_LOOPBACK_INIT, 443, "rate=50000000 cnxrate=4000000 maxcnx=8" };
+struct mapping sim_map_dns = { &sim_map_www, "dns.sim", IN6ADDR_ANY_INIT,     5300, "", SIM_HOSTNAME };
+struct mapping sim_map_cname    = { &sim_map_dns,      "cname.sim",    IN6ADDR_ANY_INIT, 5301, "", "alias.stub.sim" };
+struct mapping sim_map_nodata   = { &sim_map_cname,    "nodata.sim",   IN6ADDR_ANY_INIT, 5302, "", "nodata.stub.sim" };
+struct mapping sim_map_servfail = { &sim_map_nodata,   "servfail.sim", IN6ADDR_ANY_INIT, 5303, "", "servfail.stub.sim" };
+struct mapping sim_map_gone     = { &sim_map_servfail, "gone.sim",     IN6ADDR_ANY_INIT, 5304, "", "gone.stub.sim" };
+
+/* The hostnames of the mappings.  The first is in the hosts file, which
+ * the resolver keeps for a minute; the stub nameserver serves the others.
+ */
+struct simname sim_names [] = {
+	{ SIM_HOSTNAME,        SIM_HOSTADDR,        60 },
+	{ "alias.stub.sim",    "2001:db8::5:1",     30 },
+	{ "nodata.stub.sim",   "::ffff:192.0.2.53", 90 },
+	{ "servfail.stub.sim", "::ffff:192.0.2.54", 120 },
+	{ "gone.stub.sim",     NULL,                7 },
+};
+
+
+
+/* Return a pseudo-random number, using xorshift64* */
+static uint32_t sim_random (void) {
+	sim_rnd ^= sim_rnd >> 12;
+	sim_rnd ^= sim_rnd << 25;
+	sim_rnd ^= sim_rnd >> 27;
+	return (uint32_t) ((sim_rnd * 2685821657736338717ULL) >> 32);
+}
+
+/* Decide whether to inject a fault, scaled down by a divisor */
+static bool sim_fault (unsigned int divisor) {
+	return (sim_random () % (1000 * divisor)) < sim_faultrate;
+}
+
+/* Report a failed check on a connection */
+static void sim_fail (struct simcnx *cnx, char *msg) {
+	fprintf (simout, "FAIL: connection %u: %s\n", cnx ? cnx->id : 0, msg);
+	sim_failures++;
+}
+
+
+/* Allocate a simulated file descriptor */
+static int sim_allocfd (int kind, struct simcnx *cnx) {
+	int fd;
+	if (sim_freefds_used == 0) {
+		unsigned int more = simsocks_allocated + 64;
+		unsigned int ctr;
+		simsocks = realloc (simsocks, more * sizeof (struct simsock));
+		sim_freefds = realloc (sim_freefds, more * sizeof (int));
+		if ((simsocks == NULL) || (sim_freefds == NULL)) {
+			fprintf (simout, "Out of memory for simulated sockets\n");
+			exit (1);
+		}
+		for (ctr = more; ctr-- > simsocks_allocated; ) {
+			simsocks [ctr].kind = SIM_FREE;
+			sim_freefds [sim_freefds_used++] = SIM_FDBASE + ctr;
+		}
+		simsocks_allocated = more;
+	}
+	fd = sim_freefds [--sim_freefds_used];
+	simsocks [fd - SIM_FDBASE].kind = kind;
+	simsocks [fd - SIM_FDBASE].cnx = cnx;
+	return fd;
+}
+
+/* Find the simulated socket for a file descriptor, or NULL */
+static struct simsock *sim_sock (int fd) {
+	if ((fd < SIM_FDBASE) || (fd >= SIM_FDBASE + simsocks_allocated)) {
+		return NULL;
+	}
+	if (simsocks [fd - SIM_FDBASE].kind == SIM_FREE) {
+		return NULL;
+	}
+	return &simsocks [fd - SIM_FDBASE];
+}
+
+
+/* Construct a ClientHello record for a label.  Some carry an extension
+ * before the server_name, as most real clients do.
+ */
+static size_t sim_make_hello (uint8_t *buf, const char *label) {
+	size_t labellen = strlen (label);
+	size_t sessidlen = (sim_random () % 2) ? 32 : 0;
+	size_t suites = 1 + sim_random () % 16;
+	bool extfirst = (sim_random () % 2);
+	size_t extlen = (extfirst ? 4 : 0) + 4 + 5 + labellen;
+	size_t hslen = 2 + 32 + 1 + sessidlen + 2 + 2 * suites + 2 + 2 + extlen;
+	size_t pos = 0;
+	size_t ctr;
+	buf [pos++] = 0x16; buf [pos++] = 0x03; buf [pos++] = 0x01;
+	buf [pos++] = (hslen + 4) >> 8; buf [pos++] = (hslen + 4);
+	buf [pos++] = 0x01;
+	buf [pos++] = hslen >> 16; buf [pos++] = hslen >> 8; buf [pos++] = hslen;
+	buf [pos++] = 0x03; buf [pos++] = 0x03;
+	for (ctr = 0; ctr < 32; ctr++) {
+		buf [pos++] = sim_random ();
+	}
+	buf [pos++] = sessidlen;
+	for (ctr = 0; ctr < sessidlen; ctr++) {
+		buf [pos++] = sim_random ();
+	}
+	buf [pos++] = (2 * suites) >> 8; buf [pos++] = (2 * suites);
+	for (ctr = 0; ctr < suites; ctr++) {
+		buf [pos++] = 0x13; buf [pos++] = 0x01 + ctr;
+	}
+	buf [pos++] = 0x01; buf [pos++] = 0x00;
+	buf [pos++] = extlen >> 8; buf [pos++] = extlen;
+	if (extfirst) {
+		// extended_master_secret, which is empty
+		buf [pos++] = 0x00; buf [pos++] = 0x17;
+		buf [pos++] = 0x00; buf [pos++] = 0x00;
+	}
+	buf [pos++] = 0x00; buf [pos++] = 0x00;
+	buf [pos++] = (5 + labellen) >> 8; buf [pos++] = (5 + labellen);
+	buf [pos++] = (3 + labellen) >> 8; buf [pos++] = (3 + labellen);
+	buf [pos++] = 0x00;
+	buf [pos++] = labellen >> 8; buf [pos++] = labellen;
+	memcpy (buf + pos, label, labellen);
+	pos += labellen;
+	return pos;
+}
+
+/* Find the mapping for a label, or NULL */
+static struct mapping *sim_find_mapping (uint8_t *label, size_t labellen) {
+	struct mapping *map;
+	for (map = mappings; map != NULL; map = map->next) {
+		if ((strlen (map->label) == labellen) && (memcmp (map->label, label, labellen) == 0)) {
+			return map;
+		}
+	}
+	return NULL;
+}
+
+/* Add a ClientHello to the set to replay.  When it carries a label that
+ * has no mapping yet, add one for it if addmap is set.  The port is used
+ * to identify the mapping.  Without a mapping for its label and client
+ * address, the daemon is expected to refuse the connection.
+ */
+static void sim_add_hello (uint8_t *rec, size_t reclen, bool addmap) {
+	struct simhello *hello = &sim_hellos [sim_hellos_used++];
+	uint8_t *label;
+	size_t labellen;
+	struct mapping *map;
+	hello->rec = rec;
+	hello->reclen = reclen;
+	record_label (rec, reclen, &label, &labellen);
+	hello->label = NULL;
+	if (label == NULL) {
+		return;
+	}
+	hello->label = strndup ((char *) label, labellen);
+	map = sim_find_mapping (label, labellen);
+	if ((map == NULL) && !addmap) {
+		return;
+	}
+	if (map == NULL) {
+		map = calloc (1, sizeof (struct mapping));
+		if (map == NULL) {
+			fprintf (simout, "Out of memory for mappings\n");
+			exit (1);
+		}
+		map->label = hello->label;
+		map->fwdaddr = in6addr_loopback;
+		map->fwdport = 10000 + sim_hellos_used;
+		map->flags = "";
+		map->next = mappings;
+		mappings = map;
+	}
+}
+
+/* Load the ClientHello records from a trace file, which holds a sequence
+ * of TLS records, as sent by clients at the start of their connections.
+ */
+static void sim_load_traces (char *filename) {
+	FILE *tf = fopen (filename, "r");
+	uint8_t hdr [5];
+	if (tf == NULL) {
+		perror ("Failed to open trace file");
+		exit (1);
+	}
+	while ((sim_hellos_used < SIM_MAXTRACES) && (fread (hdr, 1, 5, tf) == 5)) {
+		size_t reclen = 5 + ((((size_t) hdr [3]) << 8) | hdr [4]);
+		uint8_t *rec = malloc (reclen);
+		if ((rec == NULL) || (reclen > MAXRECLEN)) {
+			fprintf (simout, "Unusable record in trace file %s\n", filename);
+			exit (1);
+		}
+		memcpy (rec, hdr, 5);
+		if (fread (rec + 5, 1, reclen - 5, tf) != reclen - 5) {
+			fprintf (simout, "Truncated record in trace file %s\n", filename);
+			exit (1);
+		}
+		sim_add_hello (rec, reclen, true);
+	}
+	fclose (tf);
+	if (sim_hellos_used == 0) {
+		fprintf (simout, "No records in trace file %s\n", filename);
+		exit (1);
+	}
+}
+
+/* Generate ClientHello records for the simulated mappings, and one for
+ * a label without a mapping, which the daemon should refuse.
+ */
+static void sim_generate_hellos (void) {
+	static char *labels [] = { "www.sim", "ssh.sim", "kdc.sim", "www.sim", "dns.sim", "unknown.sim",
+			"www.sim", "cname.sim", "nodata.sim", "servfail.sim", "gone.sim" };
+	unsigned int ctr;
+	for (ctr = 0; ctr < sizeof (labels) / sizeof (labels [0]); ctr++) {
+		uint8_t *rec = malloc (MAXRECLEN);
+		if (rec == NULL) {
+			fprintf (simout, "Out of memory for records\n");
+			exit (1);
+		}
+		sim_add_hello (rec, sim_make_hello (rec, labels [ctr]), false);
+	}
+}
+
+
+/* Fill a stream with TLS-framed records of random sizes.  Most records
+ * are small, as for interactive traffic, with some bulk ones in between.
+ * The stream starts at offset pos, after any ClientHello.  Returns the
+ * length of the stream.
+ */
+static size_t sim_fill_stream (uint8_t *buf, size_t pos, unsigned int records) {
+	while (records-- > 0) {
+		size_t len = 1 + sim_random () % ((sim_random () % 4) ? 256 : 16384);
+		uint8_t fill = sim_random ();
+		buf [pos++] = 0x17; buf [pos++] = 0x03; buf [pos++] = 0x03;
+		buf [pos++] = len >> 8; buf [pos++] = len;
+		memset (buf + pos, fill, len);
+		buf [pos + len - 1] = records;
+		pos += len;
+	}
+	return pos;
+}
+
+/* Tell whether an address falls under a prefix */
+static bool sim_prefix_match (struct addrprefix *pfx, struct in6_addr *addr) {
+	unsigned int bit;
+	for (bit = 0; bit < pfx->len; bit++) {
+		if ((pfx->addr.s6_addr [bit / 8] ^ addr->s6_addr [bit / 8]) & (0x80 >> (bit % 8))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Find the port that a client should reach for a label, or 0 if it
+ * should be refused.  This scans all mappings for the longest matching
+ * prefix, independently of the routetable used by the daemon.
+ */
+static uint16_t sim_expect_port (char *label, struct in6_addr *peer) {
+	struct mapping *map;
+	int bestlen = -1;
+	uint16_t port = 0;
+	unsigned int ctr;
+	if (label == NULL) {
+		return 0;
+	}
+	for (map = mappings; map != NULL; map = map->next) {
+		if (strcmp (map->label, label) != 0) {
+			continue;
+		}
+		if ((map->from_count == 0) && (bestlen < 0)) {
+			bestlen = 0;
+			port = map->fwdport;
+		}
+		for (ctr = 0; ctr < map->from_count; ctr++) {
+			if ((map->from [ctr].len > bestlen) && sim_prefix_match (&map->from [ctr], peer)) {
+				bestlen = map->from [ctr].len;
+				port = map->fwdport;
+			}
+		}
+	}
+	return port;
+}
+
+/* Find the mapping that connects to a port, or NULL */
+static struct mapping *sim_port_mapping (uint16_t port) {
+	struct mapping *map;
+	for (map = mappings; map != NULL; map = map->next) {
+		if (map->fwdport == port) {
+			return map;
+		}
+	}
+	return NULL;
+}
+
+/* Find the entry for the hostname that a mapping forwards to, or NULL */
+static struct simname *sim_name (struct mapping *map) {
+	unsigned int ctr;
+	if ((map == NULL) || (map->fwdhost == NULL)) {
+		return NULL;
+	}
+	for (ctr = 0; ctr < sizeof (sim_names) / sizeof (sim_names [0]); ctr++) {
+		if (strcmp (sim_names [ctr].name, map->fwdhost) == 0) {
+			return &sim_names [ctr];
+		}
+	}
+	return NULL;
+}
+
+/* Pick a client address, either IPv4-mapped or IPv6, and either inside
+ * or outside the prefixes of the routed mappings.
+ */
+static void sim_pick_peer (struct in6_addr *peer) {
+	uint32_t rnd = sim_random ();
+	memset (peer, 0, sizeof (*peer));
+	switch (rnd % 4) {
+	case 0:		// ::ffff:10.x.y.z
+	case 1:		// ::ffff:192.0.2.z
+		peer->s6_addr [10] = peer->s6_addr [11] = 0xff;
+		peer->s6_addr [12] = (rnd % 4 == 0) ? 10 : 192;
+		peer->s6_addr [13] = (rnd % 4 == 0) ? (rnd >> 8) : 0;
+		peer->s6_addr [14] = (rnd % 4 == 0) ? (rnd >> 16) : 2;
+		peer->s6_addr [15] = rnd >> 24;
+		break;
+	case 2:		// 2001:db8:1::/48
+	case 3:		// 2001:db8:2::/48
+		peer->s6_addr [0] = 0x20; peer->s6_addr [1] = 0x01;
+		peer->s6_addr [2] = 0x0d; peer->s6_addr [3] = 0xb8;
+		peer->s6_addr [5] = (rnd % 4 == 2) ? 1 : 2;
+		peer->s6_addr [14] = rnd >> 16;
+		peer->s6_addr [15] = rnd >> 24;
+		break;
+	}
+}
+
+/* Start a new connection, waiting to be accepted by the daemon */
+static void sim_start (void) {
+	struct simcnx *cnx = &sim_cnx [sim_started];
+	struct simhello *hello = &sim_hellos [sim_started % sim_hellos_used];
+	struct mapping *map;
+	size_t maxlen = hello->reclen + sim_records * MAXRECLEN;
+	memset (cnx, 0, sizeof (struct simcnx));
+	cnx->id = sim_started++;
+	cnx->clientfd = cnx->serverfd = -1;
+	sim_pick_peer (&cnx->peer);
+	cnx->port = sim_expect_port (hello->label, &cnx->peer);
+	cnx->expect = (cnx->port != 0) ? SIM_OK : SIM_REFUSED;
+	map = (cnx->port != 0) ? sim_port_mapping (cnx->port) : NULL;
+	cnx->capped = (map != NULL) && (map->maxcnx != 0);
+	if ((sim_name (map) != NULL) && (sim_name (map)->addr == NULL)) {
+		cnx->expect = SIM_REFUSED;
+	}
+	cnx->upbuf = malloc (maxlen);
+	cnx->dnbuf = malloc (sim_records * MAXRECLEN);
+	if ((cnx->upbuf == NULL) || (cnx->dnbuf == NULL)) {
+		fprintf (simout, "Out of memory for streams\n");
+		exit (1);
+	}
+	memcpy (cnx->upbuf, hello->rec, hello->reclen);
+	cnx->hellolen = hello->reclen;
+	cnx->uplen = sim_fill_stream (cnx->upbuf, hello->reclen, sim_records);
+	cnx->dnlen = sim_fill_stream (cnx->dnbuf, 0, sim_records);
+}
+
+/* Finish a connection once the daemon closed all its sockets.  Check that
+ * it ended for the expected reason, and that it passed on all data if it
+ * was not refused or reset.
+ */
+static void sim_finish (struct simcnx *cnx) {
+	int outcome;
+	if ((cnx->clientfd != -1) || (cnx->serverfd != -1) || cnx->finished) {
+		return;
+	}
+	if (cnx->reset) {
+		outcome = SIM_RESET;
+	} else if (!cnx->connected) {
+		outcome = SIM_REFUSED;
+		if ((cnx->expect != SIM_REFUSED) && !cnx->capped) {
+			sim_fail (cnx, "closed without connecting to a server");
+		}
+	} else {
+		outcome = SIM_OK;
+		if (cnx->expect != SIM_OK) {
+			sim_fail (cnx, "connected to a server but should be refused");
+		}
+		if ((cnx->upwritten != cnx->uplen) || (cnx->dnwritten != cnx->dnlen)) {
+			sim_fail (cnx, "closed before passing on all data");
+		}
+		if ((cnx->port == sim_map_lan.fwdport) && !(cnx->lowclient && cnx->lowserver)) {
+			sim_fail (cnx, "low-latency mode not setup on both sides");
+		}
+	}
+	sim_outcome [outcome]++;
+	cnx->finished = true;
+	sim_finished++;
+	free (cnx->upbuf);
+	free (cnx->dnbuf);
+	cnx->upbuf = cnx->dnbuf = NULL;
+}
+
+
+/* Let the network make progress.  Data arrives at the daemon in chunks
+ * of random size, and servers only respond after receiving ClientHello.
+ * A client hangs up when all data has been passed on in both directions.
+ * Returns whether anything changed.
+ */
+static bool sim_network (void) {
+	bool progress = false;
+	unsigned int ctr;
+	while ((sim_started < sim_connections) && (sim_started - sim_finished < sim_parallel)) {
+		sim_start ();
+		progress = true;
+	}
+	while ((sim_unfinished < sim_started) && sim_cnx [sim_unfinished].finished) {
+		sim_unfinished++;
+	}
+	for (ctr = sim_unfinished; ctr < sim_started; ctr++) {
+		struct simcnx *cnx = &sim_cnx [ctr];
+		if (cnx->finished || cnx->reset) {
+			continue;
+		}
+		if ((cnx->clientfd != -1) && (cnx->upavail < cnx->uplen)) {
+			cnx->upavail += 1 + sim_random () % 32768;
+			if (cnx->upavail > cnx->uplen) {
+				cnx->upavail = cnx->uplen;
+			}
+			progress = true;
+		}
+		if ((cnx->serverfd != -1) && (cnx->upwritten >= cnx->hellolen) && (cnx->dnavail < cnx->dnlen)) {
+			cnx->dnavail += 1 + sim_random () % 32768;
+			if (cnx->dnavail > cnx->dnlen) {
+				cnx->dnavail = cnx->dnlen;
+			}
+			progress = true;
+		}
+		if (!cnx->hangup && cnx->connected && (cnx->upwritten == cnx->uplen) && (cnx->dnwritten == cnx->dnlen)) {
+			cnx->hangup = true;
+			progress = true;
+		}
+	}
+	return progress;
+}
+
+/* Compute the events that poll() would return on a simulated socket */
+static short sim_revents (struct pollfd *pfd) {
+	struct simsock *ss = sim_sock (pfd->fd);
+	struct simcnx *cnx;
+	short revents = 0;
+	if (pfd->fd < 0) {
+		return 0;
+	}
+	if (ss == NULL) {
+		return POLLNVAL;
+	}
+	if (ss->kind == SIM_LISTENER) {
+		if (sim_accepted < sim_started) {
+			revents |= POLLIN;
+		}
+		return revents & pfd->events;
+	}
+	cnx = ss->cnx;
+	if (cnx->reset) {
+		return POLLERR | POLLHUP;
+	}
+	if ((ss->kind == SIM_CLIENT) && cnx->hangup) {
+		return POLLHUP;
+	}
+	if (ss->kind == SIM_CLIENT) {
+		if (cnx->upread < cnx->upavail) {
+			revents |= POLLIN;
+		}
+	} else {
+		if (cnx->dnread < cnx->dnavail) {
+			revents |= POLLIN;
+		}
+	}
+	revents |= POLLOUT;
+	return revents & pfd->events;
+}
+
+
+/* Count the lookups that the resolver thread has yet to report */
+static unsigned int sim_pending (void) {
+	struct mapping *map, *first;
+	unsigned int pending = 0;
+	for (map = mappings; map != NULL; map = map->next) {
+		if ((map->fwdcache == NULL) || !map->fwdcache->pending) {
+			continue;
+		}
+		first = mappings;
+		while (first->fwdcache != map->fwdcache) {
+			first = first->next;
+		}
+		if (first == map) {
+			pending++;
+		}
+	}
+	return pending;
+}
+
+/* Compute the events that poll() would return on the resolver pipe.
+ * Completed lookups are only reported while connections wait for them,
+ * or when the daemon would otherwise wait forever; this then waits in
+ * real time until the resolver thread reported all pending lookups, so
+ * that the daemon sees them at once.  The connections that the daemon
+ * retries are queued for sim_connect(), in the downward order of
+ * retry_resolving(), except those for a name that does not resolve.
+ */
+static short sim_resolver_revents (struct pollfd *pfd, bool stalled) {
+	struct pollfd real = { pfd->fd, POLLIN, 0 };
+	unsigned int pending = sim_pending ();
+	unsigned int held = 0;
+	unsigned int ctr;
+	int avail = 0;
+	pollidx_t idx;
+	if (pending == 0) {
+		return 0;
+	}
+	sim_retries_used = sim_retries_next = 0;
+	if (polls_used > sim_retries_allocated) {
+		sim_retries = realloc (sim_retries, polls_used * sizeof (struct simcnx *));
+		if (sim_retries == NULL) {
+			fprintf (simout, "Out of memory for retries\n");
+			exit (1);
+		}
+		sim_retries_allocated = polls_used;
+	}
+	for (idx = polls_used; idx-- > POLLIDX_PROXIES; ) {
+		if (!proxy_resolving (proxies + idx)) {
+			continue;
+		}
+		held++;
+		if (sim_name (proxies [idx].proxymap)->addr != NULL) {
+			sim_retries [sim_retries_used++] = sim_sock (polls [idx].fd)->cnx;
+		}
+	}
+	if ((held == 0) && !stalled) {
+		return 0;
+	}
+	while (avail < pending * sizeof (struct hostcache *)) {
+		if ((poll (&real, 1, -1) != 1) || (ioctl (real.fd, FIONREAD, &avail) == -1)) {
+			perror ("Failed to wait for the resolver");
+			exit (1);
+		}
+		if (avail < pending * sizeof (struct hostcache *)) {
+			usleep (1000);
+		}
+	}
+	for (ctr = 0; ctr < sizeof (sim_names) / sizeof (sim_names [0]); ctr++) {
+		if ((sim_names [ctr].hc != NULL) && sim_names [ctr].hc->pending) {
+			sim_names [ctr].looked_up = true;
+		}
+	}
+	sim_resolved_at = sim_now;
+	sim_held += held;
+	return POLLIN & pfd->events;
+}
+
+/* Check the cache entries of the names that were just looked up, for
+ * the address and the TTL that the resolver should have found.  The
+ * daemon committed them at a time between their report and now.
+ */
+static void sim_check_lookups (void) {
+	unsigned int ctr;
+	for (ctr = 0; ctr < sizeof (sim_names) / sizeof (sim_names [0]); ctr++) {
+		struct simname *sn = &sim_names [ctr];
+		uint64_t ttl = sn->ttl * 1000000000ULL;
+		struct in6_addr addr;
+		bool ok;
+		if (!sn->looked_up) {
+			continue;
+		}
+		sn->looked_up = false;
+		ok = !sn->hc->pending && (sn->hc->expires >= sim_resolved_at + ttl) && (sn->hc->expires <= sim_now + ttl);
+		if (sn->addr == NULL) {
+			ok = ok && !sn->hc->valid;
+		} else {
+			inet_pton (AF_INET6, sn->addr, &addr);
+			ok = ok && sn->hc->valid && (memcmp (&sn->hc->addr, &addr, 16) == 0);
+		}
+		if (!ok) {
+			fprintf (simout, "FAIL: lookup of %s did not find %s for %u seconds\n", sn->name, (sn->addr != NULL) ? sn->addr : "nothing", sn->ttl);
+			sim_failures++;
+		}
+	}
+}
+
+/* Simulated poll(), which lets the network progress until events occur.
+ * It ends the daemon loop when all connections have finished, and also
+ * when the daemon waits forever without anything left to happen.
+ */
+static int sim_poll (struct pollfd *fds, nfds_t nfds, int timeout) {
+	int ready = 0;
+	sim_events++;
+	if (sim_retries_next < sim_retries_used) {
+		fprintf (simout, "FAIL: %u connections not retried after resolving\n", sim_retries_used - sim_retries_next);
+		sim_failures++;
+	}
+	sim_retries_used = sim_retries_next = 0;
+	sim_check_lookups ();
+	while (ready == 0) {
+		bool progress = sim_network ();
+		struct pollfd *resolver = NULL;
+		nfds_t ctr;
+		if (sim_finished == sim_connections) {
+			interrupted = 1;
+			errno = EINTR;
+			return -1;
+		}
+		for (ctr = 0; ctr < nfds; ctr++) {
+			if ((fds [ctr].fd == resolve_fd ()) && (fds [ctr].fd >= 0)) {
+				// Not held back, as the queue of retries is set
+				resolver = &fds [ctr];
+				resolver->revents = sim_resolver_revents (resolver, false);
+				ready += (resolver->revents != 0) ? 1 : 0;
+				continue;
+			}
+			fds [ctr].revents = sim_revents (&fds [ctr]);
+			if ((fds [ctr].revents != 0) && sim_fault (1)) {
+				// Hold back events, to reorder them
+				fds [ctr].revents = 0;
+				progress = true;
+			}
+			if (fds [ctr].revents != 0) {
+				ready++;
+			}
+		}
+		if ((ready == 0) && !progress && (timeout < 0) && (resolver != NULL)) {
+			resolver->revents = sim_resolver_revents (resolver, true);
+			ready += (resolver->revents != 0) ? 1 : 0;
+		}
+		sim_now += 1000;
+		if (ready == 0) {
+			if (timeout >= 0) {
+				sim_now += ((uint64_t) timeout) * 1000000;
+				return 0;
+			}
+			if (!progress) {
+				fprintf (simout, "Daemon stalled at %u of %u finished connections\n", sim_finished, sim_connections);
+				sim_failures++;
+				interrupted = 1;
+				errno = EINTR;
+				return -1;
+			}
+		}
+	}
+	return ready;
+}
+
+/* Simulated accept() */
+static int sim_accept (int sox, struct in6_addr *peer) {
+	struct simcnx *cnx;
+	sim_events++;
+	if (sim_accepted >= sim_started) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (sim_emfile || sim_fault (4)) {
+		sim_emfile = true;
+		errno = EMFILE;
+		return -1;
+	}
+	cnx = &sim_cnx [sim_accepted++];
+	cnx->clientfd = sim_allocfd (SIM_CLIENT, cnx);
+	*peer = cnx->peer;
+	if (sim_refusing) {
+		// Accepted with the spare, to be closed right away
+		sim_refusing = false;
+		cnx->expect = SIM_REFUSED;
+		return cnx->clientfd;
+	}
+	if (sim_clients >= setting_maxcnx) {
+		sim_fail (cnx, "accept() beyond the connection cap");
+	}
+	if (sim_atcap && (sim_clients > setting_maxcnx - 1 - setting_maxcnx / 10)) {
+		sim_fail (cnx, "accept() resumed before connections dropped below the cap");
+	}
+	cnx->counted = true;
+	sim_atcap = (++sim_clients >= setting_maxcnx);
+	return cnx->clientfd;
+}
+
+/* Simulated connect().  The daemon connects to a server right after it
+ * reads a complete ClientHello, so that identifies the connection.  After
+ * lookups, it connects the connections that waited for them instead, one
+ * name after another, so the port tells which of them is next.
+ */
+static int sim_connect (struct in6_addr *addr, uint16_t port) {
+	struct simcnx *cnx = sim_lastread;
+	struct in6_addr hostaddr;
+	struct mapping *map;
+	struct simname *sn;
+	unsigned int ctr;
+	sim_events++;
+	if (sim_retries_next < sim_retries_used) {
+		cnx = NULL;
+		for (ctr = 0; ctr < sim_retries_used; ctr++) {
+			if ((sim_retries [ctr] != NULL) && (sim_retries [ctr]->port == port)) {
+				cnx = sim_retries [ctr];
+				sim_retries [ctr] = NULL;
+				sim_retries_next++;
+				break;
+			}
+		}
+	}
+	if ((cnx == NULL) || (cnx->serverfd != -1) || cnx->connected) {
+		sim_fail (cnx, "connect() without a fresh ClientHello");
+		errno = EINVAL;
+		return -1;
+	}
+	if (port != cnx->port) {
+		sim_fail (cnx, "connect() to the server for another label");
+	}
+	map = sim_port_mapping (port);
+	if ((map != NULL) && (map->maxcnx != 0)) {
+		unsigned int ctr, servers = 0;
+		for (ctr = sim_unfinished; ctr < sim_started; ctr++) {
+			if ((sim_cnx [ctr].serverfd != -1) && (sim_cnx [ctr].port == port)) {
+				servers++;
+			}
+		}
+		if (servers >= map->maxcnx) {
+			sim_fail (cnx, "connect() beyond the cap of the mapping");
+		}
+	}
+	sn = sim_name (map);
+	if ((sn != NULL) && ((sn->addr == NULL) || (inet_pton (AF_INET6, sn->addr, &hostaddr) != 1) || (memcmp (addr, &hostaddr, 16) != 0))) {
+		sim_fail (cnx, "connect() to another address than the hostname has");
+	}
+	if (sim_fault (4)) {
+		cnx->expect = SIM_REFUSED;
+		errno = ECONNREFUSED;
+		return -1;
+	}
+	cnx->connected = true;
+	cnx->serverfd = sim_allocfd (SIM_SERVER, cnx);
+	return cnx->serverfd;
+}
+
+/* Simulated read(), which may return less than requested */
+static ssize_t sim_read (int fd, void *buf, size_t len) {
+	struct simsock *ss = sim_sock (fd);
+	struct simcnx *cnx;
+	uint8_t *stream;
+	size_t *rdpos, avail;
+	sim_events++;
+	if ((ss == NULL) || (ss->cnx == NULL)) {
+		errno = EBADF;
+		return -1;
+	}
+	cnx = ss->cnx;
+	if (!cnx->reset && sim_fault (64)) {
+		cnx->reset = true;
+	}
+	if (cnx->reset) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	if (ss->kind == SIM_CLIENT) {
+		stream = cnx->upbuf;
+		rdpos = &cnx->upread;
+		avail = cnx->upavail - cnx->upread;
+	} else {
+		stream = cnx->dnbuf;
+		rdpos = &cnx->dnread;
+		avail = cnx->dnavail - cnx->dnread;
+	}
+	if ((avail == 0) || sim_fault (1)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if (len > avail) {
+		len = avail;
+	}
+	if ((len > 1) && sim_fault (1)) {
+		len = 1 + sim_random () % (len - 1);
+	}
+	memcpy (buf, stream + *rdpos, len);
+	*rdpos += len;
+	sim_lastread = cnx;
+	return len;
+}
+
+/* Simulated write(), which checks that the data is what the other side
+ * sent, and may accept less than offered.
+ */
+static ssize_t sim_write (int fd, const void *buf, size_t len) {
+	struct simsock *ss = sim_sock (fd);
+	struct simcnx *cnx;
+	uint8_t *stream;
+	size_t *wrpos, streamlen;
+	sim_events++;
+	if ((ss == NULL) || (ss->cnx == NULL)) {
+		errno = EBADF;
+		return -1;
+	}
+	cnx = ss->cnx;
+	if (!cnx->reset && sim_fault (64)) {
+		cnx->reset = true;
+	}
+	if (cnx->reset) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	if (ss->kind == SIM_SERVER) {
+		stream = cnx->upbuf;
+		wrpos = &cnx->upwritten;
+		streamlen = cnx->uplen;
+	} else {
+		stream = cnx->dnbuf;
+		wrpos = &cnx->dnwritten;
+		streamlen = cnx->dnlen;
+	}
+	if (sim_fault (1)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if ((len > 1) && sim_fault (1)) {
+		len = 1 + sim_random () % (len - 1);
+	}
+	if (*wrpos + len > streamlen) {
+		sim_fail (cnx, "wrote more data than was sent");
+		len = streamlen - *wrpos;
+	}
+	if (memcmp (buf, stream + *wrpos, len) != 0) {
+		sim_fail (cnx, "wrote other data than was sent");
+	}
+	*wrpos += len;
+	return len;
+}
+
+/* Simulated close() */
+static int sim_close (int fd) {
+	struct simsock *ss = sim_sock (fd);
+	struct simcnx *cnx;
+	sim_events++;
+	if (ss == NULL) {
+		fprintf (simout, "FAIL: close() of unknown file descriptor %d\n", fd);
+		sim_failures++;
+		errno = EBADF;
+		return -1;
+	}
+	cnx = ss->cnx;
+	if (ss->kind == SIM_CLIENT) {
+		cnx->clientfd = -1;
+		if (cnx->counted) {
+			cnx->counted = false;
+			sim_clients--;
+		}
+	} else if (ss->kind == SIM_SERVER) {
+		cnx->serverfd = -1;
+	} else if (ss->kind == SIM_SPARE) {
+		sim_spares--;
+	}
+	//
+	// A file descriptor is free again; if it is the spare, the daemon
+	// uses it to accept and close a connection
+	//
+	if (sim_emfile) {
+		sim_emfile = false;
+		sim_refusing = (ss->kind == SIM_SPARE);
+	}
+	if (sim_lastread == cnx) {
+		sim_lastread = NULL;
+	}
+	ss->kind = SIM_FREE;
+	sim_freefds [sim_freefds_used++] = fd;
+	if (cnx != NULL) {
+		sim_finish (cnx);
+	}
+	return 0;
+}
+
+/* Simulated reserve() of a spare file descriptor, of which the daemon
+ * should hold no more than one.
+ */
+static int sim_reserve (void) {
+	sim_events++;
+	if (sim_spares++ > 0) {
+		sim_fail (NULL, "reserve() while holding a spare");
+	}
+	return sim_allocfd (SIM_SPARE, NULL);
+}
+
+/* Simulated clock */
+static uint64_t sim_clock (void) {
+	return sim_now;
+}
+
+/* Simulated low-latency mode, which checks the socket and notes that it
+ * is setup.  It may fail as busy polling does without privileges, which
+ * still sets up the rest.
+ */
+static int sim_lowlatency (int fd, uint32_t usec) {
+	struct simsock *ss = sim_sock (fd);
+	if ((ss == NULL) || (ss->cnx == NULL)) {
+		sim_fail ((ss != NULL) ? ss->cnx : NULL, "lowlatency() on a socket that is no connection");
+		errno = EBADF;
+		return -1;
+	}
+	if (ss->kind == SIM_CLIENT) {
+		ss->cnx->lowclient = true;
+	} else {
+		ss->cnx->lowserver = true;
+	}
+	if (sim_fault (1)) {
+		errno = EPERM;
+		return -1;
+	}
+	return 0;
+}
+
+struct iobackend io_sim = {
+	sim_accept,
+	sim_connect,
+	sim_read,
+	sim_write,
+	sim_close,
+	sim_reserve,
+	sim_poll,
+	sim_clock,
+	sim_lowlatency,
+};
+
+
+/* Append a dotted name to a DNS message */
+static size_t sim_dns_name (uint8_t *msg, size_t pos, const char *name) {
+	while (*name != '\0') {
+		size_t len = strcspn (name, ".");
+		msg [pos++] = len;
+		memcpy (msg + pos, name, len);
+		pos += len;
+		name += len;
+		if (*name == '.') {
+			name++;
+		}
+	}
+	msg [pos++] = 0;
+	return pos;
+}
+
+/* Append a resource record to a DNS message, owned by a name or, for
+ * NULL, by the name in the question.  The data is an address in text
+ * for A and AAAA records, a name for CNAME records, and the name of the
+ * zone for SOA records, whose minimum is the TTL of negative answers.
+ */
+static size_t sim_dns_rr (uint8_t *msg, size_t pos, const char *owner, uint16_t type, uint32_t ttl, const char *data, uint32_t negttl) {
+	size_t rdpos;
+	if (owner == NULL) {
+		msg [pos++] = 0xc0; msg [pos++] = 12;
+	} else {
+		pos = sim_dns_name (msg, pos, owner);
+	}
+	msg [pos++] = type >> 8; msg [pos++] = type;
+	msg [pos++] = 0; msg [pos++] = 1;	// class IN
+	msg [pos++] = ttl >> 24; msg [pos++] = ttl >> 16; msg [pos++] = ttl >> 8; msg [pos++] = ttl;
+	rdpos = pos += 2;
+	switch (type) {
+	case SIM_DNS_A:
+		inet_pton (AF_INET, data, msg + pos);
+		pos += 4;
+		break;
+	case SIM_DNS_AAAA:
+		inet_pton (AF_INET6, data, msg + pos);
+		pos += 16;
+		break;
+	case SIM_DNS_CNAME:
+		pos = sim_dns_name (msg, pos, data);
+		break;
+	case SIM_DNS_SOA:
+		pos = sim_dns_name (msg, pos, data);
+		pos = sim_dns_name (msg, pos, data);
+		memset (msg + pos, 0, 16);
+		pos += 16;
+		msg [pos++] = negttl >> 24; msg [pos++] = negttl >> 16; msg [pos++] = negttl >> 8; msg [pos++] = negttl;
+		break;
+	}
+	msg [rdpos - 2] = (pos - rdpos) >> 8;
+	msg [rdpos - 1] = (pos - rdpos);
+	return pos;
+}
+
+/* Compose the answer of the stub nameserver to a question.  Returns its
+ * length.  Records for other names than asked for should be ignored, so
+ * the address of decoy.stub.sim is never to be connected to.
+ */
+static size_t sim_stub_answer (uint8_t *msg, uint16_t id, const char *name, uint16_t qtype) {
+	size_t pos;
+	uint8_t rcode = 0;
+	unsigned int ancount = 0, nscount = 0;
+	msg [0] = id >> 8; msg [1] = id;
+	msg [2] = 0x81; msg [3] = 0x80;		// response, RD, RA
+	pos = sim_dns_name (msg, 12, name);
+	msg [pos++] = qtype >> 8; msg [pos++] = qtype;
+	msg [pos++] = 0; msg [pos++] = 1;	// class IN
+	if ((strcmp (name, "alias.stub.sim") == 0) && (qtype == SIM_DNS_AAAA)) {
+		pos = sim_dns_rr (msg, pos, "decoy.stub.sim", SIM_DNS_AAAA, 300, "2001:db8::bad", 0);
+		pos = sim_dns_rr (msg, pos, NULL, SIM_DNS_CNAME, 30, "target.stub.sim", 0);
+		pos = sim_dns_rr (msg, pos, "target.stub.sim", SIM_DNS_AAAA, 300, "2001:db8::5:1", 0);
+		ancount = 3;
+	} else if ((strcmp (name, "decoy.stub.sim") == 0) && (qtype == SIM_DNS_AAAA)) {
+		pos = sim_dns_rr (msg, pos, NULL, SIM_DNS_AAAA, 300, "2001:db8::bad", 0);
+		ancount = 1;
+	} else if ((strcmp (name, "nodata.stub.sim") == 0) && (qtype == SIM_DNS_AAAA)) {
+		pos = sim_dns_rr (msg, pos, "stub.sim", SIM_DNS_SOA, 600, "stub.sim", 60);
+		nscount = 1;
+	} else if ((strcmp (name, "nodata.stub.sim") == 0) && (qtype == SIM_DNS_A)) {
+		pos = sim_dns_rr (msg, pos, NULL, SIM_DNS_A, 90, "192.0.2.53", 0);
+		ancount = 1;
+	} else if ((strcmp (name, "servfail.stub.sim") == 0) && (qtype == SIM_DNS_AAAA)) {
+		rcode = 2;
+	} else if ((strcmp (name, "servfail.stub.sim") == 0) && (qtype == SIM_DNS_A)) {
+		pos = sim_dns_rr (msg, pos, NULL, SIM_DNS_A, 120, "192.0.2.54", 0);
+		ancount = 1;
+	} else if ((strcmp (name, "gone.stub.sim") == 0) && (qtype == SIM_DNS_AAAA)) {
+		rcode = 3;
+		pos = sim_dns_rr (msg, pos, "stub.sim", SIM_DNS_SOA, 600, "stub.sim", 7);
+		nscount = 1;
+	} else {
+		// Not asked for by a correct resolver
+		rcode = 5;
+	}
+	msg [3] |= rcode;
+	msg [4] = 0; msg [5] = 1;
+	msg [6] = 0; msg [7] = ancount;
+	msg [8] = 0; msg [9] = nscount;
+	msg [10] = 0; msg [11] = 0;
+	return pos;
+}
+
+/* The stub nameserver, which runs in a thread of its own because it
+ * answers the resolver thread in real time.  A query for the AAAA
+ * records of alias.stub.sim is first answered for another question,
+ * with the same ID, which the resolver should ignore.
+ */
+static void *sim_stub_thread (void *arg) {
+	while (true) {
+		uint8_t query [512], answer [512];
+		struct sockaddr_storage from;
+		socklen_t fromlen = sizeof (from);
+		ssize_t querylen;
+		char name [256];
+		size_t pos = 12, namelen = 0;
+		uint16_t id, qtype;
+		querylen = recvfrom (sim_stub_sox, query, sizeof (query), 0, (struct sockaddr *) &from, &fromlen);
+		if (querylen < 12) {
+			continue;
+		}
+		while ((pos < querylen) && (query [pos] != 0) && (namelen + query [pos] + 1 < sizeof (name))) {
+			if (namelen > 0) {
+				name [namelen++] = '.';
+			}
+			memcpy (name + namelen, query + pos + 1, query [pos]);
+			namelen += query [pos];
+			pos += 1 + query [pos];
+		}
+		if (pos + 5 > querylen) {
+			continue;
+		}
+		name [namelen] = '\0';
+		id = (query [0] << 8) | query [1];
+		qtype = (query [pos + 1] << 8) | query [pos + 2];
+		if ((strcmp (name, "alias.stub.sim") == 0) && (qtype == SIM_DNS_AAAA)) {
+			sendto (sim_stub_sox, answer, sim_stub_answer (answer, id, "decoy.stub.sim", qtype), 0, (struct sockaddr *) &from, fromlen);
+		}
+		sendto (sim_stub_sox, answer, sim_stub_answer (answer, id, name, qtype), 0, (struct sockaddr *) &from, fromlen);
+	}
+	return NULL;
+}
+
+/* Start the stub nameserver on a loopback port, and let the resolver
+ * use it.  Returns -1 on failure.
+ */
+static int sim_stub_start (void) {
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof (sin);
+	pthread_t thread;
+	memset (&sin, 0, sizeof (sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	sim_stub_sox = socket (AF_INET, SOCK_DGRAM, 0);
+	if ((sim_stub_sox == -1) ||
+			(bind (sim_stub_sox, (struct sockaddr *) &sin, sizeof (sin)) == -1) ||
+			(getsockname (sim_stub_sox, (struct sockaddr *) &sin, &sinlen) == -1) ||
+			(pthread_create (&thread, NULL, sim_stub_thread, NULL) != 0)) {
+		return -1;
+	}
+	pthread_detach (thread);
+	snprintf (sim_nameserver, sizeof (sim_nameserver), "127.0.0.1#%u", ntohs (sin.sin_port));
+	setting_nameserver = sim_nameserver;
+	return 0;
+}
+
+
+/* Main program */
+int main (int argc, char *argv []) {
+	int opt;
+	int listener;
+	struct mapping *map;
+	struct timespec t0, t1;
+	double secs;
+	FILE *hosts;
+	int hostsfd;
+	unsigned int ctr;
+	bool resolved = false;
+	//
+	// Commandline.
+	//
+	while ((opt = getopt (argc, argv, "s:n:p:r:f:t:T:v")) != -1) {
+		switch (opt) {
+		case 's':
+			sim_seed = strtoull (optarg, NULL, 0);
+			break;
+		case 'n':
+			sim_connections = strtoul (optarg, NULL, 0);
+			break;
+		case 'p':
+			sim_parallel = strtoul (optarg, NULL, 0);
+			break;
+		case 'r':
+			sim_records = strtoul (optarg, NULL, 0);
+			break;
+		case 'f':
+			sim_faultrate = strtoul (optarg, NULL, 0);
+			break;
+		case 't':
+			sim_tracefile = optarg;
+			break;
+		case 'T':
+			setting_tracesample = strtoul (optarg, NULL, 0);
+			sim_tracedump = true;
+			break;
+		case 'v':
+			sim_verbose = true;
+			break;
+		default:
+			fprintf (stderr, "Usage: %s [-s seed] [-n connections] [-p parallel] [-r records] [-f faults_per_mille] [-t tracefile] [-T tracesample] [-v]\n", argv [0]);
+			exit (1);
+		}
+	}
+	if ((sim_parallel == 0) || (sim_faultrate >= 1000)) {
+		fprintf (stderr, "%s: Need -p above 0 and -f below 1000\n", argv [0]);
+		exit (1);
+	}
+	sim_rnd = sim_seed ? sim_seed : 1;
+	//
+	// Output.  The daemon is chatty, so only show that with -v.
+	//
+	simout = fdopen (dup (1), "w");
+	if (!sim_verbose) {
+		freopen ("/dev/null", "w", stdout);
+		freopen ("/dev/null", "w", stderr);
+	}
+	//
+	// Connections and their ClientHello records.
+	//
+	sim_cnx = calloc (sim_connections, sizeof (struct simcnx));
+	if (sim_cnx == NULL) {
+		fprintf (simout, "Out of memory for connections\n");
+		exit (1);
+	}
+	mappings = &sim_map_gone;
+	if (sim_tracefile != NULL) {
+		sim_load_traces (sim_tracefile);
+	} else {
+		sim_generate_hellos ();
+	}
+	//
+	// Hosts file, for the backend of dns.sim.  The names of the stub
+	// nameserver are not in it.
+	//
+	hostsfd = mkstemp (sim_hostsfile);
+	hosts = (hostsfd != -1) ? fdopen (hostsfd, "w") : NULL;
+	if (hosts == NULL) {
+		fprintf (simout, "Failed to create a hosts file\n");
+		exit (1);
+	}
+	fprintf (hosts, "# Written by snitch-sim\n%s %s\n", SIM_HOSTADDR, SIM_HOSTNAME);
+	fclose (hosts);
+	setting_hostsfile = sim_hostsfile;
+	//
+	// Stub nameserver, for the other hostnames.
+	//
+	if (sim_stub_start () == -1) {
+		fprintf (simout, "Failed to start the stub nameserver\n");
+		exit (1);
+	}
+	//
+	// Daemon.
+	//
+	io = &io_sim;
+	now = io->clock ();
+	if (setup_mappings (mappings) == -1) {
+		fprintf (simout, "Failed to setup mappings\n");
+		exit (1);
+	}
+	for (map = mappings; map != NULL; map = map->next) {
+		if (sim_name (map) != NULL) {
+			sim_name (map)->hc = map->fwdcache;
+		}
+	}
+	setting_maxcnx = (sim_parallel > 1) ? (sim_parallel * 3 / 4) : 1;
+	spare_fd = io->reserve ();
+	listener = sim_allocfd (SIM_LISTENER, NULL);
+	if (setup_pollfds (listener) == -1) {
+		fprintf (simout, "Failed to setup the listener\n");
+		exit (1);
+	}
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	daemon_loop ();
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+	unlink (sim_hostsfile);
+	//
+	// Checks.
+	//
+	for (ctr = 0; ctr < sim_started; ctr++) {
+		if (sim_cnx [ctr].connected && (sim_name (sim_port_mapping (sim_cnx [ctr].port)) != NULL)) {
+			resolved = true;
+		}
+	}
+	if (resolved && (sim_held == 0)) {
+		fprintf (simout, "FAIL: no connection waited for resolving a hostname\n");
+		sim_failures++;
+	}
+	if (polls_used != POLLIDX_PROXIES) {
+		fprintf (simout, "FAIL: %u pollfd structures left after all connections ended\n", polls_used - POLLIDX_PROXIES);
+		sim_failures++;
+	}
+	if (cnx_active != 0) {
+		fprintf (simout, "FAIL: %u connections counted after all connections ended\n", cnx_active);
+		sim_failures++;
+	}
+	for (map = mappings; map != NULL; map = map->next) {
+		if (map->cnx_active != 0) {
+			fprintf (simout, "FAIL: %u connections counted for %s after all connections ended\n", map->cnx_active, map->label);
+			sim_failures++;
+		}
+	}
+	//
+	// Report.
+	//
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	fprintf (simout, "Seed %llu: %u connections, %u passed, %u refused, %u reset\n",
+			(unsigned long long) sim_seed, sim_finished,
+			sim_outcome [SIM_OK], sim_outcome [SIM_REFUSED], sim_outcome [SIM_RESET]);
+	fprintf (simout, "%llu events in %.3f s = %.0f events/s, %.3f s simulated\n",
+			(unsigned long long) sim_events, secs, sim_events / secs,
+			(sim_now - 1000000000ULL) / 1e9);
+	if (sim_tracedump) {
+		trace_dump (simout);
+	}
+	fprintf (simout, "%s: %u failures\n", (sim_failures == 0) ? "PASS" : "FAIL", sim_failures);
+	cleanup ();
+	exit ((sim_failures == 0) ? 0 : 1);
+}
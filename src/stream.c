@@ -6,7 +6,9 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <signal.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #include <unistd.h>
 #include <errno.h>
@@ -14,15 +16,17 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include <poll.h>
+
 #include <netinet/in.h>
 
 #include "fun.h"
 
 
-/* Receive a (partial) record from the stream.
+/* Receive a (partial) record from the stream, reading at most maxlen bytes.
  * Returns 1 when a record is fully loaded, 0 for more to do, -1 for error.
  */
-static int recv_partial_record (int cnx, uint8_t *buf, size_t *sofar) {
+static int recv_partial_record (int cnx, uint8_t *buf, size_t *sofar, size_t maxlen) {
 	size_t minlen = 5;
 	size_t didlen = *sofar;
 	size_t iolen;
@@ -32,10 +36,14 @@ static int recv_partial_record (int cnx, uint8_t *buf, size_t *sofar) {
 			  (((size_t) buf [4])     );
 	}
 	printf ("receiving minlen = %d, didlen = %d, iolen = ???\n", minlen, didlen);
-	iolen = read (cnx, buf + didlen, minlen - didlen);
+	iolen = minlen - didlen;
+	if (iolen > maxlen) {
+		iolen = maxlen;
+	}
+	iolen = io->read (cnx, buf + didlen, iolen);
 	printf ("receiving minlen = %d, didlen = %d, iolen = %d\n", minlen, didlen, iolen);
 	if (iolen == -1) {
-		if ((errno == EWOULDBLOCK) && (errno == EAGAIN)) {
+		if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) {
 			return 0;
 		}
 		perror ("Communication failure");
@@ -61,10 +69,10 @@ static int send_partial_record (int cnx, uint8_t *buf, size_t *sofar, size_t snd
 	size_t didlen = *sofar;
 	size_t iolen;
 	printf ("Sending sndlen = %d, didlen = %d, iolen = ???\n", sndlen, didlen);
-	iolen = write (cnx, buf + didlen, sndlen - didlen);
+	iolen = io->write (cnx, buf + didlen, sndlen - didlen);
 	printf ("sending sndlen = %d, didlen = %d, iolen = %d\n", sndlen, didlen, iolen);
 	if (iolen == -1) {
-		if ((errno == EWOULDBLOCK) && (errno == EAGAIN)) {
+		if ((errno == EWOULDBLOCK) || (errno == EAGAIN)) {
 			return 0;
 		}
 		perror ("Communication failure");
@@ -84,21 +92,24 @@ static int send_partial_record (int cnx, uint8_t *buf, size_t *sofar, size_t snd
 }
 
 
-/* Receive a TLS record or part of it from the proxy.
- * Updates the proxy to write state when complete.
+/* Receive a TLS record or part of it from the proxy, but no more
+ * than maxlen bytes.  Updates the proxy to write state when complete.
+ * Returns the number of bytes read.
  */
-void recv_record (int sox, struct proxy *pxy) {
-	switch (recv_partial_record (sox, pxy->rdbuf, &pxy->read)) {
+size_t recv_record (int sox, struct proxy *pxy, size_t maxlen) {
+	size_t before = pxy->read;
+	switch (recv_partial_record (sox, pxy->rdbuf, &pxy->read, maxlen)) {
 	case 1:
 		set_proxymode (pxy, PROXY_MODE_SEND);
 		pxy->written = 0;
 		break;
 	case -1:
 		set_proxymode (pxy, PROXY_MODE_ERROR);
-		break;
+		return 0;
 	default:
 		break;
 	}
+	return (pxy->read > before) ? (pxy->read - before) : 0;
 }
 
 
@@ -199,7 +210,7 @@ printf ("Extension length = %d\n", skiplen);
 		if (pos + 4 + skiplen > recbuflen) {
 			return;
 		}
-		if ((recbuf [pos + 0] == 0x00) || (recbuf [pos + 1] == 0x00)) {
+		if ((recbuf [pos + 0] == 0x00) && (recbuf [pos + 1] == 0x00) && (skiplen >= 5)) {
 			//TODO// Dive into the Server Name structure
 			*label = &recbuf [pos + 4 + 5];
 			*labellen = skiplen - 5;
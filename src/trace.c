@@ -0,0 +1,193 @@
+/* snitch/trace.c -- Lifecycle tracing of sampled connections.
+ *
+ * Every connection passes through the same stages: it is accepted, its
+ * label is found in the ClientHello, a downstream connection is made,
+ * and the ClientHello is passed on.  Each stage fires a USDT probe for
+ * perf or bpftrace, when built with <sys/sdt.h>.  In addition, one in
+ * setting_tracesample connections has its stages logged into a ring of
+ * recent events, which is dumped on SIGUSR1.  Unsampled connections
+ * only cost a test of their flags.
+ *
+ * For all connections, the relay latency of each record is kept in a
+ * histogram, from the wakeup in which the daemon started reading it to
+ * the moment it was passed on.  Connections in low-latency mode have
+ * their own histogram, so the two can be compared.  The percentiles are
+ * dumped along with the ring.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <signal.h>
+#include <string.h>
+
+#include <poll.h>
+
+#include <netinet/in.h>
+
+#include "fun.h"
+
+
+/* A logged event, with the time since the connection was accepted.
+ * Once known, the label of the connection is kept with its events,
+ * truncated to fit.
+ */
+#define TRACE_LABELSIZE 32
+
+struct traceevent {
+	uint64_t stamp;
+	uint64_t elapsed;
+	uint32_t cnxid;
+	uint32_t arg;
+	uint16_t event;
+	char label [TRACE_LABELSIZE];
+};
+
+/* The ring of recent events, which overwrites the oldest when full */
+#define TRACE_RINGSIZE 4096
+
+static struct traceevent tracering [TRACE_RINGSIZE];
+static uint64_t trace_logged = 0;
+static uint32_t trace_counter = 0;
+
+static char *trace_names [] = {
+	"none", "accept", "label", "connect", "hello_sent", "park", "refuse", "shutdown"
+};
+
+/* Latency histograms with 8 buckets for each power of two nanoseconds,
+ * so percentiles are within 12.5% of the actual latency.
+ */
+#define LATENCY_SUBBITS 3
+#define LATENCY_BUCKETS (64 << LATENCY_SUBBITS)
+
+static uint64_t latency_hist [2] [LATENCY_BUCKETS];
+static uint64_t latency_count [2];
+
+static char *latency_names [] = { "normal", "busypoll" };
+
+
+/* Decide whether a new connection is sampled for the event ring.  When
+ * it is, the proxy is marked as traced and its start time is set.
+ */
+void trace_sample (struct proxy *pxy) {
+	if (setting_tracesample == 0) {
+		return;
+	}
+	if (++trace_counter < setting_tracesample) {
+		return;
+	}
+	trace_counter = 0;
+	pxy->flags |= PROXY_TRACED;
+	pxy->since = io->clock ();
+}
+
+/* Log an event with a label into the ring */
+static void trace_log (struct proxy *pxy, uint16_t event, uint32_t arg, const char *label, size_t labellen) {
+	struct traceevent *te = &tracering [trace_logged++ % TRACE_RINGSIZE];
+	if (labellen >= TRACE_LABELSIZE) {
+		labellen = TRACE_LABELSIZE - 1;
+	}
+	te->stamp = io->clock ();
+	te->elapsed = te->stamp - pxy->since;
+	te->cnxid = pxy->cnxid;
+	te->arg = arg;
+	te->event = event;
+	memcpy (te->label, label, labellen);
+	te->label [labellen] = '\0';
+}
+
+/* Log an event for a traced proxy into the ring, with the label of its
+ * mapping if it has one yet.
+ */
+void trace_event (struct proxy *pxy, uint16_t event, uint32_t arg) {
+	if (pxy->proxymap != NULL) {
+		trace_log (pxy, event, arg, pxy->proxymap->label, strlen (pxy->proxymap->label));
+	} else {
+		trace_log (pxy, event, arg, "", 0);
+	}
+}
+
+/* Log the label of a traced proxy into the ring, with its length */
+void trace_event_label (struct proxy *pxy, uint8_t *label, size_t labellen) {
+	trace_log (pxy, TRACE_LABEL, labellen, (char *) label, labellen);
+}
+
+/* Return the histogram bucket for a latency */
+static unsigned int latency_bucket (uint64_t ns) {
+	unsigned int msb;
+	if (ns < (1 << LATENCY_SUBBITS)) {
+		return ns;
+	}
+	msb = 63 - __builtin_clzll (ns);
+	return ((msb - LATENCY_SUBBITS + 1) << LATENCY_SUBBITS) | ((ns >> (msb - LATENCY_SUBBITS)) & ((1 << LATENCY_SUBBITS) - 1));
+}
+
+/* Return the highest latency that falls in a histogram bucket */
+static uint64_t latency_bucket_max (unsigned int bucket) {
+	unsigned int shift;
+	if (bucket < (1 << LATENCY_SUBBITS)) {
+		return bucket;
+	}
+	shift = (bucket >> LATENCY_SUBBITS) - 1;
+	return ((((uint64_t) (bucket & ((1 << LATENCY_SUBBITS) - 1)) | (1 << LATENCY_SUBBITS)) + 1) << shift) - 1;
+}
+
+/* Return the latency below which a fraction of the records, in parts
+ * per thousand, was relayed.
+ */
+static uint64_t latency_percentile (unsigned int class, unsigned int permille) {
+	uint64_t want = (latency_count [class] * permille + 999) / 1000;
+	uint64_t seen = 0;
+	unsigned int bucket;
+	for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+		seen += latency_hist [class] [bucket];
+		if (seen >= want) {
+			break;
+		}
+	}
+	return latency_bucket_max (bucket);
+}
+
+/* Record the relay latency of a record that a proxy side passed on at
+ * the given time, in the histogram for its mode.
+ */
+void trace_latency (struct proxy *pxy, uint64_t passed) {
+	unsigned int class = (pxy->proxymap->busypoll != 0) ? LATENCY_BUSYPOLL : LATENCY_NORMAL;
+	latency_hist [class] [latency_bucket (passed - pxy->rxstamp)]++;
+	latency_count [class]++;
+	TRACE_PROBE (relay, pxy->cnxid, (passed - pxy->rxstamp) / 1000);
+}
+
+/* Dump the ring of events, oldest first, and the relay latencies */
+void trace_dump (FILE *out) {
+	unsigned int class;
+	uint64_t first = (trace_logged > TRACE_RINGSIZE) ? (trace_logged - TRACE_RINGSIZE) : 0;
+	uint64_t evt;
+	fprintf (out, "Trace of %llu events, sampling 1 in %u connections\n",
+			(unsigned long long) (trace_logged - first), setting_tracesample);
+	for (evt = first; evt < trace_logged; evt++) {
+		struct traceevent *te = &tracering [evt % TRACE_RINGSIZE];
+		fprintf (out, "%llu.%09llu cnx %u +%llu us %s %u%s%s\n",
+				(unsigned long long) (te->stamp / 1000000000),
+				(unsigned long long) (te->stamp % 1000000000),
+				te->cnxid,
+				(unsigned long long) (te->elapsed / 1000),
+				(te->event < sizeof (trace_names) / sizeof (trace_names [0])) ? trace_names [te->event] : "?",
+				te->arg,
+				(te->label [0] != '\0') ? " " : "",
+				te->label);
+	}
+	for (class = LATENCY_NORMAL; class <= LATENCY_BUSYPOLL; class++) {
+		if (latency_count [class] == 0) {
+			continue;
+		}
+		fprintf (out, "Relay latency of %llu %s records: p50 %llu ns, p99 %llu ns, p99.9 %llu ns\n",
+				(unsigned long long) latency_count [class],
+				latency_names [class],
+				(unsigned long long) latency_percentile (class, 500),
+				(unsigned long long) latency_percentile (class, 990),
+				(unsigned long long) latency_percentile (class, 999));
+	}
+	fflush (out);
+}